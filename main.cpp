@@ -1,20 +1,69 @@
 #include <SDL.h>
 #include <SDL_image.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
 #include <string>
+#include <vector>
 #include <SDL_mixer.h>
+#include <SDL_ttf.h>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PARTICLES_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef _WIN32
+//Before windows.h, which pulls in the old Winsock otherwise
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <io.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
 
 //The dimensions of the level
 const int LEVEL_WIDTH = 4098;
 const int LEVEL_HEIGHT = 700;
 const int GRAVITY = 3;
+//Edge of a terrain tile in pixels
+const int TILE_SIZE = 16;
 
 //Screen dimension constants
 const int SCREEN_WIDTH = 1000;
 const int SCREEN_HEIGHT = 700;
 
+//Audio buffer length in sample frames
+const int AUDIO_BUFFER_FRAMES = 2048;
+
 const int startPosX = 200;
-const int startPosY = 550;
+const int startPosY = 548;
+//Pixels a shot travels each frame
+const int SHOT_SPEED = 6;
+
+//Frame rate cap of the menus, which only change on input
+const int MENU_FPS = 30;
 
 //The window we'll be rendering tob
 SDL_Window* gWindow = NULL;
@@ -26,6 +75,789 @@ SDL_Rect camera = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
 enum GameState { START, PAUSE, EXIT, WIN, OVER, MENU };
 GameState state = MENU;
 
+//Times the phases of startup and the assets loaded in them, reported once the first frame is up
+class StartupTrace{
+public:
+	//Initializes variables
+	StartupTrace();
+
+	//Marks the start of the process
+	void start();
+
+	//Opens a phase, phases opened inside it are nested
+	void begin(const char* name);
+
+	//Closes the newest open phase
+	void end();
+
+	//Records an asset loaded in the current phase, times are performance counter ticks
+	void asset(const std::string& path, Sint64 bytes, Uint64 decode, Uint64 upload);
+
+	//Where the assets come from
+	void setSource(const char* source);
+
+	//Where the report goes, stdout if empty
+	void setReport(std::string path);
+
+	//Exit once the first frame is up
+	void setProfile(bool profile);
+
+	//Call after every present. Writes the report on the first one and returns
+	//true when the game should exit because it is only being profiled.
+	bool frame_presented();
+
+	//Writes the phases, the assets and the totals
+	void report(FILE* out);
+private:
+	struct Phase{
+		const char* name;
+		int depth;
+		Uint64 begin;
+		Uint64 end;
+	};
+	struct Asset{
+		std::string path;
+		const char* phase;
+		Sint64 bytes;
+		Uint64 decode;
+		Uint64 upload;
+	};
+
+	double ms(Uint64 ticks) const;
+
+	Uint64 mStart;
+	Uint64 mFirstFrame;
+	std::vector<Phase> mPhases;
+	//Indices of the open phases
+	std::vector<int> mOpen;
+	std::vector<Asset> mAssets;
+	const char* mSource;
+	std::string mReportPath;
+	bool mProfile;
+};
+
+StartupTrace::StartupTrace()
+{
+	mStart = 0;
+	mFirstFrame = 0;
+	mSource = "loose files";
+	mReportPath = "startup.txt";
+	mProfile = false;
+}
+
+void StartupTrace::start()
+{
+	mStart = SDL_GetPerformanceCounter();
+}
+
+void StartupTrace::begin(const char* name)
+{
+	Phase phase = { name, (int)mOpen.size(), SDL_GetPerformanceCounter(), 0 };
+	mOpen.push_back((int)mPhases.size());
+	mPhases.push_back(phase);
+}
+
+void StartupTrace::end()
+{
+	if (mOpen.empty())
+		return;
+	mPhases[mOpen.back()].end = SDL_GetPerformanceCounter();
+	mOpen.pop_back();
+}
+
+void StartupTrace::asset(const std::string& path, Sint64 bytes, Uint64 decode, Uint64 upload)
+{
+	//Only startup is traced, later loads are not reported
+	if (mFirstFrame != 0)
+		return;
+	Asset asset = { path, mOpen.empty() ? "" : mPhases[mOpen.back()].name, bytes, decode, upload };
+	mAssets.push_back(asset);
+}
+
+void StartupTrace::setSource(const char* source)
+{
+	mSource = source;
+}
+
+void StartupTrace::setReport(std::string path)
+{
+	mReportPath = path;
+}
+
+void StartupTrace::setProfile(bool profile)
+{
+	mProfile = profile;
+}
+
+bool StartupTrace::frame_presented()
+{
+	if (mFirstFrame != 0)
+		return false;
+	mFirstFrame = SDL_GetPerformanceCounter();
+	FILE* out = mReportPath.empty() ? stdout : fopen(mReportPath.c_str(), "w");
+	if (out == NULL)
+	{
+		printf("Unable to write startup report %s!\n", mReportPath.c_str());
+		return mProfile;
+	}
+	report(out);
+	if (out != stdout)
+		fclose(out);
+	return mProfile;
+}
+
+double StartupTrace::ms(Uint64 ticks) const
+{
+	return ticks * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+void StartupTrace::report(FILE* out)
+{
+	fprintf(out, "Startup, assets from %s\n", mSource);
+	fprintf(out, "  %-40s %10s %10s\n", "phase", "start ms", "ms");
+	for (size_t i = 0; i < mPhases.size(); i++){
+		const Phase& phase = mPhases[i];
+		char name[64];
+		snprintf(name, sizeof(name), "%*s%s", phase.depth * 2, "", phase.name);
+		fprintf(out, "  %-40s %10.2f %10.2f\n", name, ms(phase.begin - mStart), phase.end != 0 ? ms(phase.end - phase.begin) : -1.0);
+	}
+	fprintf(out, "\n  %-40s %-14s %10s %10s %10s\n", "asset", "phase", "bytes", "decode ms", "upload ms");
+	Sint64 bytes = 0;
+	Uint64 decode = 0, upload = 0;
+	for (size_t i = 0; i < mAssets.size(); i++){
+		const Asset& asset = mAssets[i];
+		fprintf(out, "  %-40s %-14s %10lld %10.2f %10.2f\n", asset.path.c_str(), asset.phase, (long long)asset.bytes, ms(asset.decode), ms(asset.upload));
+		bytes += asset.bytes;
+		decode += asset.decode;
+		upload += asset.upload;
+	}
+	fprintf(out, "  %-40s %-14s %10lld %10.2f %10.2f\n", "total", "", (long long)bytes, ms(decode), ms(upload));
+	//The same file decoded more than once is time that sharing the result would save
+	std::map<std::string, int> loads;
+	for (size_t i = 0; i < mAssets.size(); i++)
+		loads[mAssets[i].path]++;
+	for (std::map<std::string, int>::iterator load = loads.begin(); load != loads.end(); ++load){
+		if (load->second > 1)
+			fprintf(out, "  note: %s was loaded %d times\n", load->first.c_str(), load->second);
+	}
+	if (mFirstFrame != 0)
+		fprintf(out, "\nFirst frame presented %.2f ms after start\n", ms(mFirstFrame - mStart));
+}
+
+//Startup timings of this run
+StartupTrace gStartup;
+
+//Read only archive of every asset, memory mapped once and read in place
+class AssetPack{
+public:
+	//Initializes variables
+	AssetPack();
+
+	//Deallocates memory
+	~AssetPack();
+
+	//Maps the archive at path, returns false when it is missing or damaged
+	bool open(std::string path);
+
+	//Unmaps the archive
+	void close();
+
+	//Opens an asset from the archive, falling back to the loose file
+	SDL_RWops* open_asset(std::string path);
+
+	//Writes the files to a new archive at path
+	static bool build(std::string path, char* files[], int count);
+private:
+	//On disk layout, fields are in the byte order of the machine that built the pack and
+	//are read in place. A pack from the other byte order fails the version check.
+	struct Header{
+		char magic[4];
+		Uint32 version;
+		Uint32 count;
+		Uint32 reserved;
+	};
+	struct Entry{
+		char name[64];
+		Uint64 offset;
+		Uint64 size;
+		Uint64 hash;
+	};
+
+	//FNV-1a hash of the asset bytes
+	static Uint64 hash(const Uint8* data, size_t size);
+
+	const Uint8* mData;
+	size_t mSize;
+	//Index of the archive by asset name
+	std::map<std::string, const Entry*> mEntries;
+	//Assets whose hash was already checked
+	std::vector<bool> mVerified;
+#ifdef _WIN32
+	HANDLE mFile;
+	HANDLE mMapping;
+#endif
+};
+
+AssetPack::AssetPack()
+{
+	//Initialize
+	mData = NULL;
+	mSize = 0;
+#ifdef _WIN32
+	mFile = INVALID_HANDLE_VALUE;
+	mMapping = NULL;
+#endif
+}
+
+AssetPack::~AssetPack()
+{
+	//Deallocate
+	close();
+}
+
+bool AssetPack::open(std::string path)
+{
+	close();
+
+	//Map the whole file read only, pages are shared through the OS cache
+#ifdef _WIN32
+	mFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mFile == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	GetFileSizeEx(mFile, &size);
+	mSize = (size_t)size.QuadPart;
+	mMapping = CreateFileMappingA(mFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mMapping != NULL)
+		mData = (const Uint8*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	int file = ::open(path.c_str(), O_RDONLY);
+	if (file < 0)
+		return false;
+	struct stat info;
+	if (fstat(file, &info) == 0 && info.st_size > 0)
+	{
+		mSize = (size_t)info.st_size;
+		void* data = mmap(NULL, mSize, PROT_READ, MAP_SHARED, file, 0);
+		if (data != MAP_FAILED)
+			mData = (const Uint8*)data;
+	}
+	//The mapping stays valid without the descriptor
+	::close(file);
+#endif
+	if (mData == NULL)
+	{
+		printf("Unable to map asset pack %s!\n", path.c_str());
+		close();
+		return false;
+	}
+
+	//Check the header and index fit in the file
+	const Header* header = (const Header*)mData;
+	if (mSize < sizeof(Header) || memcmp(header->magic, "SRPK", 4) != 0 || header->version != 1 || (mSize - sizeof(Header)) / sizeof(Entry) < header->count)
+	{
+		printf("Asset pack %s is damaged!\n", path.c_str());
+		close();
+		return false;
+	}
+	const Entry* entries = (const Entry*)(mData + sizeof(Header));
+	for (Uint32 i = 0; i < header->count; i++){
+		if (entries[i].offset > mSize || entries[i].size > mSize - entries[i].offset || entries[i].name[sizeof(entries[i].name) - 1] != '\0')
+		{
+			printf("Asset pack %s has a damaged entry %u!\n", path.c_str(), i);
+			close();
+			return false;
+		}
+		mEntries[entries[i].name] = &entries[i];
+	}
+	mVerified.assign(header->count, false);
+	return true;
+}
+
+void AssetPack::close()
+{
+	//Unmap archive if it exists
+	if (mData != NULL)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(mData);
+#else
+		munmap((void*)mData, mSize);
+#endif
+		mData = NULL;
+		mSize = 0;
+	}
+#ifdef _WIN32
+	if (mMapping != NULL)
+	{
+		CloseHandle(mMapping);
+		mMapping = NULL;
+	}
+	if (mFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(mFile);
+		mFile = INVALID_HANDLE_VALUE;
+	}
+#endif
+	mEntries.clear();
+	mVerified.clear();
+}
+
+SDL_RWops* AssetPack::open_asset(std::string path)
+{
+	std::map<std::string, const Entry*>::iterator found = mEntries.find(path);
+	if (found == mEntries.end())
+	{
+		//Loose files keep working during development
+		return SDL_RWFromFile(path.c_str(), "rb");
+	}
+	const Entry* entry = found->second;
+	const Uint8* data = mData + entry->offset;
+
+	//Check integrity the first time the asset is used
+	size_t index = entry - (const Entry*)(mData + sizeof(Header));
+	if (!mVerified[index])
+	{
+		if (hash(data, (size_t)entry->size) != entry->hash)
+		{
+			printf("Asset %s failed its integrity check!\n", path.c_str());
+			return NULL;
+		}
+		mVerified[index] = true;
+	}
+	return SDL_RWFromConstMem(data, (int)entry->size);
+}
+
+Uint64 AssetPack::hash(const Uint8* data, size_t size)
+{
+	Uint64 value = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; i++){
+		value ^= data[i];
+		value *= 1099511628211ULL;
+	}
+	return value;
+}
+
+//32 bit FNV-1a of size bytes, continues from value
+Uint32 fnv1a(const void* data, size_t size, Uint32 value = 2166136261U)
+{
+	const Uint8* bytes = (const Uint8*)data;
+	for (size_t i = 0; i < size; i++){
+		value ^= bytes[i];
+		value *= 16777619U;
+	}
+	return value;
+}
+
+bool AssetPack::build(std::string path, char* files[], int count)
+{
+	std::vector<Entry> entries(count);
+	std::vector<std::vector<Uint8> > contents(count);
+
+	//Read every file and fill in the index
+	Uint64 offset = sizeof(Header) + sizeof(Entry) * count;
+	for (int i = 0; i < count; i++){
+		if (strlen(files[i]) >= sizeof(entries[i].name))
+		{
+			printf("Asset name %s is too long!\n", files[i]);
+			return false;
+		}
+		FILE* file = fopen(files[i], "rb");
+		if (file == NULL)
+		{
+			printf("Unable to open asset %s!\n", files[i]);
+			return false;
+		}
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		contents[i].resize(size);
+		size_t read = size > 0 ? fread(&contents[i][0], 1, size, file) : 0;
+		fclose(file);
+		if (read != (size_t)size)
+		{
+			printf("Unable to read asset %s!\n", files[i]);
+			return false;
+		}
+
+		memset(&entries[i], 0, sizeof(Entry));
+		strcpy(entries[i].name, files[i]);
+		//Align each asset to 16 bytes
+		offset = (offset + 15) & ~(Uint64)15;
+		entries[i].offset = offset;
+		entries[i].size = size;
+		entries[i].hash = hash(size > 0 ? &contents[i][0] : NULL, size);
+		offset += size;
+	}
+
+	FILE* out = fopen(path.c_str(), "wb");
+	if (out == NULL)
+	{
+		printf("Unable to create asset pack %s!\n", path.c_str());
+		return false;
+	}
+	Header header;
+	memcpy(header.magic, "SRPK", 4);
+	header.version = 1;
+	header.count = count;
+	header.reserved = 0;
+	bool success = fwrite(&header, sizeof(header), 1, out) == 1;
+	if (count > 0)
+		success = success && fwrite(&entries[0], sizeof(Entry), count, out) == (size_t)count;
+	for (int i = 0; i < count && success; i++){
+		static const Uint8 padding[16] = { 0 };
+		long position = ftell(out);
+		success = fwrite(padding, 1, (size_t)(entries[i].offset - position), out) == (size_t)(entries[i].offset - position);
+		if (!contents[i].empty())
+			success = success && fwrite(&contents[i][0], 1, contents[i].size(), out) == contents[i].size();
+		printf("%-32s %8u bytes  %016llx\n", entries[i].name, (unsigned)entries[i].size, (unsigned long long)entries[i].hash);
+	}
+	success = fclose(out) == 0 && success;
+	if (!success)
+		printf("Unable to write asset pack %s!\n", path.c_str());
+	return success;
+}
+
+//Every asset is loaded through the pack
+AssetPack gAssets;
+
+//Draws one layer of the scene, data is what the layer was set with
+typedef void (*DrawLayer)(void* data);
+
+//Redraws only the parts of the window that changed when drawing falls back to the
+//software renderer, where every pixel costs CPU time. The scenery is drawn once into
+//a cached layer and again only when the camera moves. The actors are drawn first in a
+//measuring pass that records where each draw lands and what it shows. Whatever appeared,
+//went away or changed since the last frame is restored from the cached layer, the
+//actors are drawn again clipped to it, and only those rectangles reach the window.
+class Compositor{
+public:
+	//Initializes variables
+	Compositor();
+
+	//Deallocates memory
+	~Compositor();
+
+	//Takes over drawing the game when gRenderer is the software renderer
+	bool init();
+
+	void free();
+
+	bool isActive() const;
+
+	//Layers of the scene, the scenery stays put while the camera does
+	void setScene(void* data, DrawLayer scenery, DrawLayer actors);
+
+	//Redraws the whole window on the next frame, after something else drew over it
+	void invalidate();
+
+	//Draws the frame seen through camera and presents the parts that changed
+	void compose(const SDL_Rect& camera);
+
+	//True while the actors are being measured, draws only mark then
+	bool isMeasuring() const;
+
+	//Marks a draw showing key at rect on the screen
+	void mark(const SDL_Rect& rect, Uint32 key);
+
+	void print_stats();
+private:
+	//More regions than this are merged, they each draw every actor again
+	static const int MAX_REGIONS = 16;
+	//Past this share of the window one full redraw is cheaper
+	static const int FULL_PERCENT = 60;
+
+	//A draw of the measuring pass
+	struct Mark{
+		SDL_Rect rect;
+		Uint32 key;
+		//Place in the drawing order
+		int order;
+	};
+	//A draw that is the same as last frame, with its place in both frames
+	struct Kept{
+		SDL_Rect rect;
+		int order;
+		int lastOrder;
+	};
+	static bool before(const Mark& a, const Mark& b);
+
+	//Adds a changed rectangle, merged with the regions it overlaps
+	void add_region(SDL_Rect rect);
+
+	//Merges the pairs of regions that grow the least until there are few enough
+	void limit_regions();
+
+	bool mActive;
+	//Next frame is redrawn whole
+	bool mFull;
+	bool mMeasuring;
+	//Scenery seen through mCamera, stale while the camera moves
+	SDL_Texture* mScenery;
+	bool mStale;
+	SDL_Rect mCamera;
+	void* mData;
+	DrawLayer mDrawScenery;
+	DrawLayer mDrawActors;
+	//Draws of this frame and the last one, sorted after measuring
+	std::vector<Mark> mMarks;
+	std::vector<Mark> mLastMarks;
+	std::vector<Kept> mKept;
+	//Rectangles redrawn this frame, they never overlap
+	std::vector<SDL_Rect> mRegions;
+
+	//Statistics
+	int mFrames;
+	int mFullFrames;
+	int mIdleFrames;
+	int mMostRegions;
+	Uint64 mPixels;
+	Uint64 mTime;
+};
+
+Compositor::Compositor()
+{
+	mActive = false;
+	mFull = true;
+	mMeasuring = false;
+	mScenery = NULL;
+	mStale = true;
+	mCamera.x = mCamera.y = mCamera.w = mCamera.h = 0;
+	mData = NULL;
+	mDrawScenery = NULL;
+	mDrawActors = NULL;
+	mFrames = 0;
+	mFullFrames = 0;
+	mIdleFrames = 0;
+	mMostRegions = 0;
+	mPixels = 0;
+	mTime = 0;
+}
+
+Compositor::~Compositor()
+{
+	free();
+}
+
+bool Compositor::init()
+{
+	free();
+	SDL_RendererInfo info;
+	if (gRenderer == NULL || SDL_GetRendererInfo(gRenderer, &info) != 0 || (info.flags & SDL_RENDERER_SOFTWARE) == 0)
+		return false;
+	//Same format as the window so restoring the scenery is a plain copy
+	mScenery = SDL_CreateTexture(gRenderer, SDL_GetWindowPixelFormat(gWindow), SDL_TEXTUREACCESS_TARGET, SCREEN_WIDTH, SCREEN_HEIGHT);
+	if (mScenery == NULL)
+	{
+		printf("Unable to create scenery layer, redrawing every frame whole! SDL Error: %s\n", SDL_GetError());
+		return false;
+	}
+	printf("Software renderer, drawing only what changes\n");
+	mActive = true;
+	mFull = true;
+	mStale = true;
+	mMarks.clear();
+	mLastMarks.clear();
+	return true;
+}
+
+void Compositor::free()
+{
+	if (mScenery != NULL)
+	{
+		SDL_DestroyTexture(mScenery);
+		mScenery = NULL;
+	}
+	mActive = false;
+}
+
+bool Compositor::isActive() const
+{
+	return mActive;
+}
+
+void Compositor::setScene(void* data, DrawLayer scenery, DrawLayer actors)
+{
+	mData = data;
+	mDrawScenery = scenery;
+	mDrawActors = actors;
+	mFull = true;
+	mStale = true;
+}
+
+void Compositor::invalidate()
+{
+	mFull = true;
+}
+
+void Compositor::compose(const SDL_Rect& camera)
+{
+	Uint64 start = SDL_GetPerformanceCounter();
+	//A moving camera moves every pixel. The scenery then goes straight to the window and
+	//is only kept once the camera stops, caching it every frame would draw it twice.
+	if (camera.x != mCamera.x || camera.y != mCamera.y){
+		mCamera = camera;
+		mFull = true;
+		mStale = true;
+	}
+	else if (mStale){
+		SDL_SetRenderTarget(gRenderer, mScenery);
+		mDrawScenery(mData);
+		SDL_SetRenderTarget(gRenderer, NULL);
+		mStale = false;
+	}
+	mMarks.clear();
+	mMeasuring = true;
+	mDrawActors(mData);
+	mMeasuring = false;
+	std::sort(mMarks.begin(), mMarks.end(), before);
+
+	//Draws that are in both frames changed nothing, the rest is where they are and were
+	mRegions.clear();
+	mKept.clear();
+	size_t i = 0, j = 0;
+	while (!mFull && (i < mMarks.size() || j < mLastMarks.size())){
+		if (j == mLastMarks.size() || (i < mMarks.size() && before(mMarks[i], mLastMarks[j])))
+			add_region(mMarks[i++].rect);
+		else if (i == mMarks.size() || before(mLastMarks[j], mMarks[i]))
+			add_region(mLastMarks[j++].rect);
+		else{
+			Kept kept = { mMarks[i].rect, mMarks[i].order, mLastMarks[j].order };
+			mKept.push_back(kept);
+			i++;
+			j++;
+		}
+	}
+	//Unchanged draws that overlap still change what shows when they swap places in the order
+	for (i = 0; i < mKept.size(); i++){
+		for (j = i + 1; j < mKept.size(); j++){
+			if ((mKept[i].order < mKept[j].order) != (mKept[i].lastOrder < mKept[j].lastOrder) && SDL_HasIntersection(&mKept[i].rect, &mKept[j].rect)){
+				add_region(mKept[i].rect);
+				add_region(mKept[j].rect);
+			}
+		}
+	}
+	limit_regions();
+	Uint64 pixels = 0;
+	for (i = 0; i < mRegions.size(); i++)
+		pixels += (Uint64)mRegions[i].w * mRegions[i].h;
+	if (mFull || pixels * 100 > (Uint64)SCREEN_WIDTH * SCREEN_HEIGHT * FULL_PERCENT){
+		SDL_Rect window = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
+		mRegions.assign(1, window);
+		pixels = (Uint64)SCREEN_WIDTH * SCREEN_HEIGHT;
+		mFullFrames++;
+	}
+
+	for (i = 0; i < mRegions.size(); i++){
+		SDL_RenderSetClipRect(gRenderer, &mRegions[i]);
+		//Only ever the whole window while stale
+		if (mStale)
+			mDrawScenery(mData);
+		else
+			SDL_RenderCopy(gRenderer, mScenery, &mRegions[i], &mRegions[i]);
+		mDrawActors(mData);
+	}
+	SDL_RenderSetClipRect(gRenderer, NULL);
+	if (!mRegions.empty()){
+		//Draws are queued until the renderer is flushed, presenting would copy the whole window
+		SDL_RenderFlush(gRenderer);
+		SDL_UpdateWindowSurfaceRects(gWindow, &mRegions[0], (int)mRegions.size());
+	}
+	else
+		mIdleFrames++;
+	mLastMarks.swap(mMarks);
+	mFull = false;
+
+	mFrames++;
+	mPixels += pixels;
+	mMostRegions = std::max(mMostRegions, (int)mRegions.size());
+	mTime += SDL_GetPerformanceCounter() - start;
+}
+
+bool Compositor::isMeasuring() const
+{
+	return mMeasuring;
+}
+
+void Compositor::mark(const SDL_Rect& rect, Uint32 key)
+{
+	if (rect.w <= 0 || rect.h <= 0)
+		return;
+	Mark mark = { rect, key, (int)mMarks.size() };
+	mMarks.push_back(mark);
+}
+
+bool Compositor::before(const Mark& a, const Mark& b)
+{
+	if (a.key != b.key)
+		return a.key < b.key;
+	if (a.rect.x != b.rect.x)
+		return a.rect.x < b.rect.x;
+	if (a.rect.y != b.rect.y)
+		return a.rect.y < b.rect.y;
+	if (a.rect.w != b.rect.w)
+		return a.rect.w < b.rect.w;
+	return a.rect.h < b.rect.h;
+}
+
+void Compositor::add_region(SDL_Rect rect)
+{
+	//Only what is on the window
+	SDL_Rect window = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
+	if (!SDL_IntersectRect(&rect, &window, &rect))
+		return;
+	//The grown rectangle may overlap regions it missed before, so start over after a merge
+	for (size_t i = 0; i < mRegions.size();){
+		if (SDL_HasIntersection(&mRegions[i], &rect)){
+			SDL_UnionRect(&mRegions[i], &rect, &rect);
+			mRegions[i] = mRegions.back();
+			mRegions.pop_back();
+			i = 0;
+		}
+		else
+			i++;
+	}
+	mRegions.push_back(rect);
+}
+
+void Compositor::limit_regions()
+{
+	while ((int)mRegions.size() > MAX_REGIONS){
+		size_t first = 0, second = 1;
+		Sint64 least = -1;
+		for (size_t i = 0; i < mRegions.size(); i++){
+			for (size_t j = i + 1; j < mRegions.size(); j++){
+				SDL_Rect merged;
+				SDL_UnionRect(&mRegions[i], &mRegions[j], &merged);
+				Sint64 growth = (Sint64)merged.w * merged.h - (Sint64)mRegions[i].w * mRegions[i].h - (Sint64)mRegions[j].w * mRegions[j].h;
+				if (least < 0 || growth < least){
+					least = growth;
+					first = i;
+					second = j;
+				}
+			}
+		}
+		SDL_Rect merged;
+		SDL_UnionRect(&mRegions[first], &mRegions[second], &merged);
+		mRegions.erase(mRegions.begin() + second);
+		mRegions.erase(mRegions.begin() + first);
+		add_region(merged);
+	}
+}
+
+void Compositor::print_stats()
+{
+	if (mFrames == 0)
+		return;
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	double pixels = (double)mPixels / mFrames;
+	printf("Compositor: %d frames, %d redrawn whole, %d with nothing to draw, at most %d regions\n", mFrames, mFullFrames, mIdleFrames, mMostRegions);
+	printf("  %.0f pixels touched per frame (%.1f%% of the window), %.3f ms per frame\n", pixels, pixels * 100 / (SCREEN_WIDTH * SCREEN_HEIGHT), mTime / frequency / mFrames * 1000);
+}
+
+//Draws only what changes on the software renderer
+Compositor gCompositor;
+
 //Texture wrapper class
 class Texture{
 public:
@@ -35,11 +867,14 @@ public:
 	//Deallocates memory
 	~Texture();
 
-	//Loads image at specified path
-	bool load_image(std::string path);
+	//Loads image at specified path, optionally keeping its pixels for mask building
+	bool load_image(std::string path, bool keepPixels = false);
 	//Deallocates texture
 	void free();
 
+	//Deallocates the pixels kept by load_image
+	void free_pixels();
+
 	//Set color modulation
 	void setColor(Uint8 red, Uint8 green, Uint8 blue);
 
@@ -60,6 +895,8 @@ public:
 	//Image dimensions
 	int mWidth;
 	int mHeight;
+	//RGBA8888 copy of the image pixels, only kept on request
+	SDL_Surface* mPixels;
 };
 
 Texture::Texture()
@@ -68,6 +905,7 @@ Texture::Texture()
 	mTexture = NULL;
 	mWidth = 0;
 	mHeight = 0;
+	mPixels = NULL;
 }
 
 Texture::~Texture()
@@ -76,7 +914,7 @@ Texture::~Texture()
 	free();
 }
 
-bool Texture::load_image(std::string path)
+bool Texture::load_image(std::string path, bool keepPixels)
 {
 	//Get rid of preexisting texture
 	free();
@@ -85,7 +923,12 @@ bool Texture::load_image(std::string path)
 	SDL_Texture* newTexture = NULL;
 
 	//Load image at specified path
-	SDL_Surface* loadedSurface = IMG_Load(path.c_str());
+	SDL_RWops* file = gAssets.open_asset(path);
+	Sint64 bytes = file != NULL ? SDL_RWsize(file) : 0;
+	Uint64 decodeStart = SDL_GetPerformanceCounter();
+	SDL_Surface* loadedSurface = IMG_Load_RW(file, 1);
+	Uint64 decode = SDL_GetPerformanceCounter() - decodeStart;
+	Uint64 upload = 0;
 	if (loadedSurface == NULL)
 	{
 		printf("Unable to load image %s! SDL_image Error: %s\n", path.c_str(), IMG_GetError());
@@ -96,7 +939,9 @@ bool Texture::load_image(std::string path)
 		SDL_SetColorKey(loadedSurface, SDL_TRUE, SDL_MapRGB(loadedSurface->format, 0, 0xFF, 0xFF));
 
 		//Create texture from surface pixels
+		Uint64 uploadStart = SDL_GetPerformanceCounter();
 		newTexture = SDL_CreateTextureFromSurface(gRenderer, loadedSurface);
+		upload = SDL_GetPerformanceCounter() - uploadStart;
 		if (newTexture == NULL)
 		{
 			printf("Unable to create texture from %s! SDL Error: %s\n", path.c_str(), SDL_GetError());
@@ -108,10 +953,18 @@ bool Texture::load_image(std::string path)
 			mHeight = loadedSurface->h;
 		}
 
+		//Keep a 32 bit copy around for collision masks
+		if (keepPixels)
+		{
+			mPixels = SDL_ConvertSurfaceFormat(loadedSurface, SDL_PIXELFORMAT_RGBA8888, 0);
+		}
+
 		//Get rid of old loaded surface
 		SDL_FreeSurface(loadedSurface);
 	}
 
+	gStartup.asset(path, bytes, decode, upload);
+
 	//Return success
 	mTexture = newTexture;
 	return mTexture != NULL;
@@ -127,6 +980,17 @@ void Texture::free()
 		mWidth = 0;
 		mHeight = 0;
 	}
+	free_pixels();
+}
+
+void Texture::free_pixels()
+{
+	//Free pixel copy if it exists
+	if (mPixels != NULL)
+	{
+		SDL_FreeSurface(mPixels);
+		mPixels = NULL;
+	}
 }
 
 void Texture::setColor(Uint8 red, Uint8 green, Uint8 blue)
@@ -158,6 +1022,32 @@ void Texture::render(int x, int y, SDL_Rect* clip, double angle, SDL_Point* cent
 		renderQuad.h = clip->h;
 	}
 
+	//Only say where and what would be drawn
+	if (gCompositor.isMeasuring())
+	{
+		SDL_Rect source = clip != NULL ? *clip : renderQuad;
+		Uint32 key = fnv1a(&mTexture, sizeof(mTexture));
+		key = fnv1a(&source, sizeof(source), key);
+		key = fnv1a(&flip, sizeof(flip), key);
+		//A tint or fade changes the pixels without moving them
+		Uint8 mods[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+		SDL_GetTextureColorMod(mTexture, &mods[0], &mods[1], &mods[2]);
+		SDL_GetTextureAlphaMod(mTexture, &mods[3]);
+		key = fnv1a(mods, sizeof(mods), key);
+		key = fnv1a(&angle, sizeof(angle), key);
+		if (center != NULL)
+			key = fnv1a(center, sizeof(*center), key);
+		//A turned texture can reach past its rectangle
+		if (angle != 0.0)
+		{
+			renderQuad.x = renderQuad.y = 0;
+			renderQuad.w = SCREEN_WIDTH;
+			renderQuad.h = SCREEN_HEIGHT;
+		}
+		gCompositor.mark(renderQuad, key);
+		return;
+	}
+
 	//Render to screen
 	SDL_RenderCopyEx(gRenderer, mTexture, clip, &renderQuad, angle, center, flip);
 }
@@ -172,16 +1062,4373 @@ int Texture::getHeight()
 	return mHeight;
 }
 
-class Character{
-protected:
+//1-bit opacity mask of one sprite frame, packed 64 pixels per word
+class BitMask{
+public:
+	//Initializes variables
+	BitMask();
+
+	//Builds the mask from the opaque pixels of clip on a RGBA8888 surface
+	void build(SDL_Surface* sheet, SDL_Rect clip, bool mirrored = false);
+
+	//Pixel exact test of two masks with their top left corners at the given points
+	static bool overlap(const BitMask* a, int ax, int ay, const BitMask* b, int bx, int by);
+
+	//Mask dimensions
+	int mWidth;
+	int mHeight;
+	//Leftmost and rightmost opaque columns, mLeft > mRight when empty
+	int mLeft;
+	int mRight;
+	//Words per row, including one zero word of padding
+	int mStride;
+	//Row major bits, pixel x of a row is bit x%64 of word x/64
+	std::vector<Uint64> mBits;
+private:
+	//Returns the 64 pixels of row starting at bit offset
+	Uint64 fetch(int row, int offset) const;
+};
+
+BitMask::BitMask()
+{
+	mWidth = 0;
+	mHeight = 0;
+	mLeft = 0;
+	mRight = -1;
+	mStride = 0;
+}
+
+void BitMask::build(SDL_Surface* sheet, SDL_Rect clip, bool mirrored)
+{
+	//Keep the clip inside the sheet
+	SDL_Rect bounds = { 0, 0, sheet->w, sheet->h };
+	if (!SDL_IntersectRect(&clip, &bounds, &clip))
+	{
+		clip.w = 0;
+		clip.h = 0;
+	}
+	mWidth = clip.w;
+	mHeight = clip.h;
+	mStride = (mWidth + 63) / 64 + 1;
+	mBits.assign(mStride * mHeight, 0);
+	mLeft = mWidth;
+	mRight = -1;
+
+	//Transparent pixels are either see through or the cyan color key
+	Uint32 key = SDL_MapRGBA(sheet->format, 0, 0xFF, 0xFF, 0xFF);
+	SDL_LockSurface(sheet);
+	for (int y = 0; y < mHeight; y++){
+		Uint32* pixels = (Uint32*)((Uint8*)sheet->pixels + (clip.y + y) * sheet->pitch) + clip.x;
+		Uint64* row = &mBits[y * mStride];
+		for (int x = 0; x < mWidth; x++){
+			Uint8 r, g, b, a;
+			SDL_GetRGBA(pixels[x], sheet->format, &r, &g, &b, &a);
+			if (a >= 0x80 && (pixels[x] | 0xFF) != key){
+				int column = mirrored ? mWidth - 1 - x : x;
+				row[column >> 6] |= (Uint64)1 << (column & 63);
+				if (column < mLeft)
+					mLeft = column;
+				if (column > mRight)
+					mRight = column;
+			}
+		}
+	}
+	SDL_UnlockSurface(sheet);
+}
+
+Uint64 BitMask::fetch(int row, int offset) const
+{
+	const Uint64* bits = &mBits[row * mStride + (offset >> 6)];
+	int shift = offset & 63;
+	if (shift == 0)
+		return bits[0];
+	//The padding word makes the read past the last word safe
+	return (bits[0] >> shift) | (bits[1] << (64 - shift));
+}
+
+bool BitMask::overlap(const BitMask* a, int ax, int ay, const BitMask* b, int bx, int by)
+{
+	//Overlapping area of the two frames
+	int left = ax > bx ? ax : bx;
+	int top = ay > by ? ay : by;
+	int right = ax + a->mWidth < bx + b->mWidth ? ax + a->mWidth : bx + b->mWidth;
+	int bottom = ay + a->mHeight < by + b->mHeight ? ay + a->mHeight : by + b->mHeight;
+	if (left >= right || top >= bottom)
+		return false;
+
+	//AND the overlapping rows a word at a time
+	int width = right - left;
+	for (int y = top; y < bottom; y++){
+		for (int x = 0; x < width; x += 64){
+			Uint64 bits = a->fetch(y - ay, left - ax + x) & b->fetch(y - by, left - bx + x);
+			if (width - x < 64)
+				bits &= ((Uint64)1 << (width - x)) - 1;
+			if (bits != 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+//Collision masks of the frames cut from one sprite sheet, in both facings
+class MaskSheet{
+public:
+	//Builds the masks of one animation from the kept pixels of sheet
+	void build(Texture& sheet, SDL_Rect* clips, int count);
+
+	//Finds the mask of a frame, NULL if it was never built
+	const BitMask* find(const SDL_Rect& clip, bool mirrored = false) const;
+
+	//Horizontal offset that keeps a mirrored frame centered where the animation is
+	int mirror_shift(const SDL_Rect& clip) const;
+private:
+	struct Frame{
+		SDL_Rect clip;
+		BitMask mask;
+		BitMask mirrored;
+		int shift;
+	};
+
+	//Finds a frame by its clip
+	const Frame* find_frame(const SDL_Rect& clip) const;
+
+	std::vector<Frame> mFrames;
+};
+
+void MaskSheet::build(Texture& sheet, SDL_Rect* clips, int count)
+{
+	if (sheet.mPixels == NULL)
+		return;
+	size_t first = mFrames.size();
+	int left = 0, right = -1;
+	for (int i = 0; i < count; i++){
+		mFrames.push_back(Frame());
+		Frame& frame = mFrames.back();
+		frame.clip = clips[i];
+		frame.mask.build(sheet.mPixels, clips[i]);
+		frame.mirrored.build(sheet.mPixels, clips[i], true);
+		//Opaque columns of the whole animation
+		if (frame.mask.mLeft <= frame.mask.mRight){
+			if (right < left || frame.mask.mLeft < left)
+				left = frame.mask.mLeft;
+			if (frame.mask.mRight > right)
+				right = frame.mask.mRight;
+		}
+	}
+	//Mirror every frame around the center of the animation, not of each pose
+	for (size_t i = first; i < mFrames.size(); i++)
+		mFrames[i].shift = right < left ? 0 : left + right - (mFrames[i].clip.w - 1);
+}
+
+const MaskSheet::Frame* MaskSheet::find_frame(const SDL_Rect& clip) const
+{
+	for (size_t i = 0; i < mFrames.size(); i++){
+		const SDL_Rect& other = mFrames[i].clip;
+		if (other.x == clip.x && other.y == clip.y && other.w == clip.w && other.h == clip.h)
+			return &mFrames[i];
+	}
+	return NULL;
+}
+
+const BitMask* MaskSheet::find(const SDL_Rect& clip, bool mirrored) const
+{
+	const Frame* frame = find_frame(clip);
+	if (frame == NULL)
+		return NULL;
+	return mirrored ? &frame->mirrored : &frame->mask;
+}
+
+int MaskSheet::mirror_shift(const SDL_Rect& clip) const
+{
+	const Frame* frame = find_frame(clip);
+	return frame != NULL ? frame->shift : 0;
+}
+
+//Rows of a sprite sheet that survive stripping the mirrored facings
+struct SheetBand{
+	int y;
+	int h;
+};
+
+//Stripped sheet layout, kept bands are stacked from the top in order
+class SheetLayout{
+public:
+	SheetLayout(const SheetBand* bands, int count, int width);
+
+	//Dimensions of the stripped sheet
+	int getWidth() const;
+	int getHeight() const;
+
+	//Moves a clip given in full sheet coordinates to its stripped place
+	void remap(SDL_Rect* clips, int count) const;
+
+	//Writes the kept bands of the full sheet at source to a new sheet at dest
+	bool strip(std::string source, std::string dest) const;
+private:
+	const SheetBand* mBands;
+	int mCount;
+	int mWidth;
+};
+
+SheetLayout::SheetLayout(const SheetBand* bands, int count, int width)
+{
+	mBands = bands;
+	mCount = count;
+	mWidth = width;
+}
+
+int SheetLayout::getWidth() const
+{
+	return mWidth;
+}
+
+int SheetLayout::getHeight() const
+{
+	int height = 0;
+	for (int i = 0; i < mCount; i++)
+		height += mBands[i].h;
+	return height;
+}
+
+void SheetLayout::remap(SDL_Rect* clips, int count) const
+{
+	for (int c = 0; c < count; c++){
+		int y = 0;
+		for (int i = 0; i < mCount; i++){
+			if (clips[c].y >= mBands[i].y && clips[c].y + clips[c].h <= mBands[i].y + mBands[i].h){
+				clips[c].y = y + clips[c].y - mBands[i].y;
+				break;
+			}
+			y += mBands[i].h;
+		}
+	}
+}
+
+bool SheetLayout::strip(std::string source, std::string dest) const
+{
+	SDL_Surface* sheet = IMG_Load(source.c_str());
+	if (sheet == NULL)
+	{
+		printf("Unable to load image %s! SDL_image Error: %s\n", source.c_str(), IMG_GetError());
+		return false;
+	}
+	SDL_Surface* stripped = SDL_CreateRGBSurfaceWithFormat(0, mWidth, getHeight(), 32, SDL_PIXELFORMAT_RGBA32);
+	if (stripped == NULL)
+	{
+		printf("Unable to create stripped sheet! SDL Error: %s\n", SDL_GetError());
+		SDL_FreeSurface(sheet);
+		return false;
+	}
+	//Copy pixels as they are, transparent areas included
+	SDL_SetSurfaceBlendMode(sheet, SDL_BLENDMODE_NONE);
+	int y = 0;
+	for (int i = 0; i < mCount; i++){
+		SDL_Rect from = { 0, mBands[i].y, mWidth, mBands[i].h };
+		SDL_Rect to = { 0, y, mWidth, mBands[i].h };
+		SDL_BlitSurface(sheet, &from, stripped, &to);
+		y += mBands[i].h;
+	}
+	bool success = IMG_SavePNG(stripped, dest.c_str()) == 0;
+	if (!success)
+		printf("Unable to save %s! SDL_image Error: %s\n", dest.c_str(), IMG_GetError());
+	else
+		printf("%s: %dx%d -> %s: %dx%d\n", source.c_str(), sheet->w, sheet->h, dest.c_str(), mWidth, getHeight());
+	SDL_FreeSurface(stripped);
+	SDL_FreeSurface(sheet);
+	return success;
+}
+
+//Right facing rows of player.png: idle, run, jump, power, attack with shot, hurt
+const SheetBand PLAYER_BANDS[] = { { 0, 120 }, { 234, 120 }, { 470, 120 }, { 712, 120 }, { 965, 103 }, { 1192, 123 } };
+const SheetLayout PLAYER_SHEET(PLAYER_BANDS, 6, 600);
+//Left facing run of dog.png
+const SheetBand DOG_BANDS[] = { { 70, 45 } };
+const SheetLayout DOG_SHEET(DOG_BANDS, 1, 672);
+
+class TextRenderer{
+public:
+	//Initializes variables
+	TextRenderer();
+
+	//Deallocates memory
+	~TextRenderer();
+
+	//Rasterizes the printable ASCII glyphs of the font at path into the atlas
+	bool load_font(std::string path, int size);
+
+	//Deallocates atlas and cached strings
+	void free();
+
+	//Queues a string, laid out every call
+	void draw(int x, int y, const char* text, SDL_Color color);
+
+	//Queues a string that rarely changes, laid out once and reused
+	void draw_cached(int x, int y, const std::string& text, SDL_Color color);
+
+	//Renders every queued glyph with one draw call
+	void flush();
+
+	//Gets width of a string in pixels
+	int getWidth(const char* text);
+	int getHeight();
+private:
+	//First and last glyph in the atlas
+	static const int FIRST_GLYPH = 32;
+	static const int LAST_GLYPH = 126;
+	//Atlas dimensions
+	static const int ATLAS_SIZE = 512;
+
+	//Glyph rectangle in the atlas and distance to the next pen position
+	struct Glyph{
+		SDL_Rect clip;
+		int advance;
+	};
+
+	//Appends one glyph quad at pen position
+	void push_glyph(const Glyph& glyph, float x, float y, SDL_Color color);
+
+	//Appends the quads of a string
+	void layout(int x, int y, const char* text, SDL_Color color);
+
+	//Marks the quads queued since first for the compositor instead of drawing them
+	void mark(size_t first, const char* text, SDL_Color color);
+
+	SDL_Texture* mAtlas;
+	Glyph mGlyphs[LAST_GLYPH - FIRST_GLYPH + 1];
+	int mLineHeight;
+	//Quads queued for this frame, buffers keep their capacity between frames
+	std::vector<SDL_Vertex> mVertices;
+	std::vector<int> mIndices;
+	//Layouts of static strings at origin with white color
+	std::map<std::string, std::vector<SDL_Vertex> > mCache;
+};
+
+TextRenderer::TextRenderer()
+{
+	//Initialize
+	mAtlas = NULL;
+	mLineHeight = 0;
+}
+
+TextRenderer::~TextRenderer()
+{
+	//Deallocate
+	free();
+}
+
+bool TextRenderer::load_font(std::string path, int size)
+{
+	//Get rid of preexisting atlas
+	free();
+
+	SDL_RWops* file = gAssets.open_asset(path);
+	Sint64 bytes = file != NULL ? SDL_RWsize(file) : 0;
+	Uint64 decodeStart = SDL_GetPerformanceCounter();
+	TTF_Font* font = TTF_OpenFontRW(file, 1, size);
+	if (font == NULL)
+	{
+		printf("Unable to load font %s! SDL_ttf Error: %s\n", path.c_str(), TTF_GetError());
+		return false;
+	}
+	mLineHeight = TTF_FontHeight(font);
+
+	//Pack the glyphs row by row into one surface
+	SDL_Surface* atlas = SDL_CreateRGBSurfaceWithFormat(0, ATLAS_SIZE, ATLAS_SIZE, 32, SDL_PIXELFORMAT_RGBA32);
+	if (atlas == NULL)
+	{
+		printf("Unable to create font atlas! SDL Error: %s\n", SDL_GetError());
+		TTF_CloseFont(font);
+		return false;
+	}
+	SDL_FillRect(atlas, NULL, SDL_MapRGBA(atlas->format, 0xFF, 0xFF, 0xFF, 0));
+	SDL_Color white = { 0xFF, 0xFF, 0xFF, 0xFF };
+	int penX = 0, penY = 0;
+	for (int c = FIRST_GLYPH; c <= LAST_GLYPH; c++){
+		Glyph& glyph = mGlyphs[c - FIRST_GLYPH];
+		glyph.clip.x = glyph.clip.y = glyph.clip.w = glyph.clip.h = 0;
+		glyph.advance = 0;
+		int minx, maxx, miny, maxy;
+		TTF_GlyphMetrics(font, c, &minx, &maxx, &miny, &maxy, &glyph.advance);
+		SDL_Surface* rendered = TTF_RenderGlyph_Blended(font, c, white);
+		if (rendered == NULL)
+			continue;
+		if (penX + rendered->w > ATLAS_SIZE){
+			penX = 0;
+			penY += mLineHeight + 1;
+		}
+		if (penY + rendered->h > ATLAS_SIZE){
+			printf("Font atlas is full at glyph '%c'!\n", c);
+			SDL_FreeSurface(rendered);
+			break;
+		}
+		//Copy alpha as is instead of blending onto the atlas
+		SDL_SetSurfaceBlendMode(rendered, SDL_BLENDMODE_NONE);
+		SDL_Rect dest = { penX, penY, rendered->w, rendered->h };
+		SDL_BlitSurface(rendered, NULL, atlas, &dest);
+		glyph.clip = dest;
+		penX += rendered->w + 1;
+		SDL_FreeSurface(rendered);
+	}
+	TTF_CloseFont(font);
+
+	Uint64 uploadStart = SDL_GetPerformanceCounter();
+	mAtlas = SDL_CreateTextureFromSurface(gRenderer, atlas);
+	SDL_FreeSurface(atlas);
+	gStartup.asset(path, bytes, uploadStart - decodeStart, SDL_GetPerformanceCounter() - uploadStart);
+	if (mAtlas == NULL)
+	{
+		printf("Unable to create font atlas texture! SDL Error: %s\n", SDL_GetError());
+		return false;
+	}
+	SDL_SetTextureBlendMode(mAtlas, SDL_BLENDMODE_BLEND);
+
+	//Room for a full HUD without growing during the game
+	mVertices.reserve(4 * 512);
+	mIndices.reserve(6 * 512);
+	return true;
+}
+
+void TextRenderer::free()
+{
+	//Free atlas if it exists
+	if (mAtlas != NULL)
+	{
+		SDL_DestroyTexture(mAtlas);
+		mAtlas = NULL;
+	}
+	mCache.clear();
+	mVertices.clear();
+	mIndices.clear();
+}
+
+void TextRenderer::push_glyph(const Glyph& glyph, float x, float y, SDL_Color color)
+{
+	float u0 = (float)glyph.clip.x / ATLAS_SIZE;
+	float v0 = (float)glyph.clip.y / ATLAS_SIZE;
+	float u1 = (float)(glyph.clip.x + glyph.clip.w) / ATLAS_SIZE;
+	float v1 = (float)(glyph.clip.y + glyph.clip.h) / ATLAS_SIZE;
+	float x1 = x + glyph.clip.w;
+	float y1 = y + glyph.clip.h;
+	SDL_Vertex corners[4] = {
+		{ { x, y }, color, { u0, v0 } },
+		{ { x1, y }, color, { u1, v0 } },
+		{ { x1, y1 }, color, { u1, v1 } },
+		{ { x, y1 }, color, { u0, v1 } }
+	};
+	for (int i = 0; i < 4; i++)
+		mVertices.push_back(corners[i]);
+}
+
+void TextRenderer::draw(int x, int y, const char* text, SDL_Color color)
+{
+	if (mAtlas == NULL)
+		return;
+	size_t first = mVertices.size();
+	layout(x, y, text, color);
+	if (gCompositor.isMeasuring())
+		mark(first, text, color);
+}
+
+void TextRenderer::layout(int x, int y, const char* text, SDL_Color color)
+{
+	float penX = (float)x;
+	for (const char* c = text; *c != '\0'; c++){
+		if (*c < FIRST_GLYPH || *c > LAST_GLYPH)
+			continue;
+		const Glyph& glyph = mGlyphs[*c - FIRST_GLYPH];
+		if (glyph.clip.w > 0)
+			push_glyph(glyph, penX, (float)y, color);
+		penX += glyph.advance;
+	}
+}
+
+void TextRenderer::draw_cached(int x, int y, const std::string& text, SDL_Color color)
+{
+	if (mAtlas == NULL)
+		return;
+	std::map<std::string, std::vector<SDL_Vertex> >::iterator found = mCache.find(text);
+	if (found == mCache.end()){
+		//Lay out once at origin and keep the quads
+		size_t first = mVertices.size();
+		SDL_Color white = { 0xFF, 0xFF, 0xFF, 0xFF };
+		layout(0, 0, text.c_str(), white);
+		found = mCache.insert(std::make_pair(text, std::vector<SDL_Vertex>(mVertices.begin() + first, mVertices.end()))).first;
+		mVertices.resize(first);
+	}
+	const std::vector<SDL_Vertex>& quads = found->second;
+	size_t first = mVertices.size();
+	for (size_t i = 0; i < quads.size(); i++){
+		SDL_Vertex vertex = quads[i];
+		vertex.position.x += x;
+		vertex.position.y += y;
+		vertex.color = color;
+		mVertices.push_back(vertex);
+	}
+	if (gCompositor.isMeasuring())
+		mark(first, text.c_str(), color);
+}
+
+void TextRenderer::mark(size_t first, const char* text, SDL_Color color)
+{
+	if (first == mVertices.size())
+		return;
+	float left = mVertices[first].position.x, top = mVertices[first].position.y;
+	float right = left, bottom = top;
+	for (size_t i = first; i < mVertices.size(); i++){
+		left = std::min(left, mVertices[i].position.x);
+		top = std::min(top, mVertices[i].position.y);
+		right = std::max(right, mVertices[i].position.x);
+		bottom = std::max(bottom, mVertices[i].position.y);
+	}
+	SDL_Rect bounds = { (int)floorf(left), (int)floorf(top), 0, 0 };
+	bounds.w = (int)ceilf(right) - bounds.x;
+	bounds.h = (int)ceilf(bottom) - bounds.y;
+	Uint32 key = fnv1a(text, strlen(text));
+	gCompositor.mark(bounds, fnv1a(&color, sizeof(color), key));
+	mVertices.resize(first);
+}
+
+void TextRenderer::flush()
+{
+	if (mVertices.empty())
+		return;
+	//Two triangles per quad
+	int quads = (int)mVertices.size() / 4;
+	for (int i = (int)mIndices.size() / 6; i < quads; i++){
+		int first = i * 4;
+		int triangles[6] = { first, first + 1, first + 2, first + 2, first + 3, first };
+		mIndices.insert(mIndices.end(), triangles, triangles + 6);
+	}
+	SDL_RenderGeometry(gRenderer, mAtlas, &mVertices[0], (int)mVertices.size(), &mIndices[0], quads * 6);
+	mVertices.clear();
+}
+
+int TextRenderer::getWidth(const char* text)
+{
+	int width = 0;
+	for (const char* c = text; *c != '\0'; c++){
+		if (*c >= FIRST_GLYPH && *c <= LAST_GLYPH)
+			width += mGlyphs[*c - FIRST_GLYPH].advance;
+	}
+	return width;
+}
+
+int TextRenderer::getHeight()
+{
+	return mLineHeight;
+}
+
+//Particle sprites in the atlas
+enum ParticleSprite { PARTICLE_DOT, PARTICLE_SPARK, PARTICLE_SPRITES };
+
+//Pulled down every frame, in pixels per frame
+const float PARTICLE_GRAVITY = 0.15f;
+//Part of the speed kept every frame
+const float PARTICLE_DRAG = 0.97f;
+
+//Short lived sparks and dust. Every property lives in its own array so a frame of
+//movement is a handful of straight loops over floats, four particles at a time with SSE2.
+//Particles are drawn with one geometry call per sprite from a small atlas built at start up.
+class ParticleSystem{
+public:
+	//Initializes variables
+	ParticleSystem();
+
+	//Deallocates memory
+	~ParticleSystem();
+
+	//Makes room for capacity particles and builds the atlas when there is a renderer
+	bool init(int capacity);
+
+	void free();
+
+	//Adds one particle, dropped when full. Speeds in pixels and life in frames.
+	void emit(float x, float y, float vx, float vy, float life, float size, SDL_Color color, ParticleSprite sprite);
+
+	//Throws count particles in every direction, pushed by biasX and biasY
+	void burst(float x, float y, int count, float speed, float life, float size, SDL_Color color, ParticleSprite sprite, float biasX = 0, float biasY = 0);
+
+	//Moves every particle a frame and removes the ones that ran out
+	void update();
+
+	//Lays out the quads of the particles the camera sees
+	void build(const SDL_Rect& camera);
+
+	//Builds and draws with one call
+	void render(const SDL_Rect& camera);
+
+	int getCount() const;
+	int getQuads() const;
+	//Name of the code path update runs
+	static const char* getPath();
+private:
+	//Atlas is one row of square sprites
+	static const int SPRITE_SIZE = 8;
+
+	float random();
+
+#ifdef PARTICLES_SSE2
+	//Writes one quad laid out four at a time at the next place of its sprite, which
+	//only moves on when the quad is visible
+	static void put_quad(int sprite, int visible, __m128 top, __m128 bottom, __m128i color, float* const corners[], SDL_Color* const colors[], int& dots, int& sparks);
+#endif
+
+	int mCount;
+	int mCapacity;
+	std::vector<float> mX;
+	std::vector<float> mY;
+	std::vector<float> mVX;
+	std::vector<float> mVY;
+	std::vector<float> mLife;
+	//One over the starting life, fades the colour out
+	std::vector<float> mFade;
+	std::vector<float> mSize;
+	std::vector<SDL_Color> mColor;
+	std::vector<Uint8> mSprite;
+	//Places of the particles that ran out during an update, in order
+	std::vector<int> mDead;
+
+	SDL_Texture* mAtlas;
+	//Corners and colours of the quads of each sprite, the only vertex data written every
+	//build. Texture coordinates depend on the sprite alone and are filled in as the
+	//buffers grow.
+	std::vector<float> mCorners[PARTICLE_SPRITES];
+	std::vector<SDL_Color> mColors[PARTICLE_SPRITES];
+	std::vector<float> mCoords[PARTICLE_SPRITES];
+	std::vector<int> mIndices;
+	//Quads laid out by the last build, of each sprite and in all, and the rectangle around them
+	int mSpriteQuads[PARTICLE_SPRITES];
+	int mQuads;
+	SDL_Rect mBounds;
+	//Builds so far, particles look different every time
+	Uint32 mBuilds;
+	Uint32 mNoise;
+};
+
+ParticleSystem::ParticleSystem()
+{
+	mCount = 0;
+	mCapacity = 0;
+	for (int s = 0; s < PARTICLE_SPRITES; s++)
+		mSpriteQuads[s] = 0;
+	mQuads = 0;
+	mBounds.x = mBounds.y = mBounds.w = mBounds.h = 0;
+	mBuilds = 0;
+	mAtlas = NULL;
+	mNoise = 1;
+}
+
+ParticleSystem::~ParticleSystem()
+{
+	free();
+}
+
+bool ParticleSystem::init(int capacity)
+{
+	free();
+	mCapacity = capacity;
+	mX.resize(capacity);
+	mY.resize(capacity);
+	mVX.resize(capacity);
+	mVY.resize(capacity);
+	mLife.resize(capacity);
+	mFade.resize(capacity);
+	mSize.resize(capacity);
+	mColor.resize(capacity);
+	mSprite.resize(capacity);
+	mDead.resize(capacity);
+	if (gRenderer == NULL)
+		return true;
+
+	//A soft round dot and a hard square spark, white so vertex colours tint them
+	SDL_Surface* atlas = SDL_CreateRGBSurfaceWithFormat(0, SPRITE_SIZE * PARTICLE_SPRITES, SPRITE_SIZE, 32, SDL_PIXELFORMAT_RGBA32);
+	if (atlas == NULL)
+	{
+		printf("Unable to create particle atlas! SDL Error: %s\n", SDL_GetError());
+		return false;
+	}
+	SDL_LockSurface(atlas);
+	for (int y = 0; y < SPRITE_SIZE; y++){
+		Uint32* row = (Uint32*)((Uint8*)atlas->pixels + y * atlas->pitch);
+		for (int x = 0; x < SPRITE_SIZE; x++){
+			float dx = x + 0.5f - SPRITE_SIZE / 2.0f, dy = y + 0.5f - SPRITE_SIZE / 2.0f;
+			float edge = 1 - sqrtf(dx * dx + dy * dy) / (SPRITE_SIZE / 2.0f);
+			Uint8 alpha = edge > 0 ? (Uint8)(edge * 255) : 0;
+			row[PARTICLE_DOT * SPRITE_SIZE + x] = SDL_MapRGBA(atlas->format, 0xFF, 0xFF, 0xFF, alpha);
+			bool inside = x >= 2 && x < SPRITE_SIZE - 2 && y >= 2 && y < SPRITE_SIZE - 2;
+			row[PARTICLE_SPARK * SPRITE_SIZE + x] = SDL_MapRGBA(atlas->format, 0xFF, 0xFF, 0xFF, inside ? 0xFF : 0);
+		}
+	}
+	SDL_UnlockSurface(atlas);
+	mAtlas = SDL_CreateTextureFromSurface(gRenderer, atlas);
+	SDL_FreeSurface(atlas);
+	if (mAtlas == NULL)
+	{
+		printf("Unable to create particle atlas texture! SDL Error: %s\n", SDL_GetError());
+		return false;
+	}
+	//Sparks light up what is behind them
+	SDL_SetTextureBlendMode(mAtlas, SDL_BLENDMODE_ADD);
+	return true;
+}
+
+void ParticleSystem::free()
+{
+	if (mAtlas != NULL)
+	{
+		SDL_DestroyTexture(mAtlas);
+		mAtlas = NULL;
+	}
+	mCount = 0;
+	for (int s = 0; s < PARTICLE_SPRITES; s++)
+		mSpriteQuads[s] = 0;
+	mQuads = 0;
+}
+
+void ParticleSystem::emit(float x, float y, float vx, float vy, float life, float size, SDL_Color color, ParticleSprite sprite)
+{
+	if (mCount == mCapacity || life <= 0)
+		return;
+	int i = mCount++;
+	mX[i] = x;
+	mY[i] = y;
+	mVX[i] = vx;
+	mVY[i] = vy;
+	mLife[i] = life;
+	mFade[i] = 1 / life;
+	mSize[i] = size;
+	mColor[i] = color;
+	mSprite[i] = (Uint8)sprite;
+}
+
+void ParticleSystem::burst(float x, float y, int count, float speed, float life, float size, SDL_Color color, ParticleSprite sprite, float biasX, float biasY)
+{
+	for (int i = 0; i < count; i++){
+		//Uneven speeds and lives so the burst doesn't look like a ring
+		float angle = random() * 6.2831853f;
+		float pace = speed * (0.3f + 0.7f * random());
+		emit(x, y, cosf(angle) * pace + biasX, sinf(angle) * pace + biasY, life * (0.5f + 0.5f * random()), size, color, sprite);
+	}
+}
+
+void ParticleSystem::update()
+{
+	//The buffers are empty when the system was made with no room
+	if (mCount == 0)
+		return;
+	float* x = &mX[0];
+	float* y = &mY[0];
+	float* vx = &mVX[0];
+	float* vy = &mVY[0];
+	float* life = &mLife[0];
+	int* dead = &mDead[0];
+	int deaths = 0;
+	int i = 0;
+#ifdef PARTICLES_SSE2
+	__m128 gravity = _mm_set1_ps(PARTICLE_GRAVITY);
+	__m128 drag = _mm_set1_ps(PARTICLE_DRAG);
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 zero = _mm_setzero_ps();
+	for (; i + 4 <= mCount; i += 4){
+		__m128 speedX = _mm_mul_ps(_mm_loadu_ps(vx + i), drag);
+		__m128 speedY = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(vy + i), drag), gravity);
+		_mm_storeu_ps(vx + i, speedX);
+		_mm_storeu_ps(vy + i, speedY);
+		_mm_storeu_ps(x + i, _mm_add_ps(_mm_loadu_ps(x + i), speedX));
+		_mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), speedY));
+		__m128 left = _mm_sub_ps(_mm_loadu_ps(life + i), one);
+		_mm_storeu_ps(life + i, left);
+		int out = _mm_movemask_ps(_mm_cmpngt_ps(left, zero));
+		if (out != 0)
+		{
+			for (int k = 0; k < 4; k++){
+				if (out & (1 << k))
+					dead[deaths++] = i + k;
+			}
+		}
+	}
+#endif
+	//The rest, or everything without SSE2
+	for (; i < mCount; i++){
+		vx[i] *= PARTICLE_DRAG;
+		vy[i] = vy[i] * PARTICLE_DRAG + PARTICLE_GRAVITY;
+		x[i] += vx[i];
+		y[i] += vy[i];
+		life[i] -= 1;
+		if (!(life[i] > 0))
+			dead[deaths++] = i;
+	}
+	//The last particle takes the place of each one that ran out. Going from the back,
+	//everything after a dead place is already alive, so only the dead are visited.
+	while (deaths > 0){
+		i = dead[--deaths];
+		int last = --mCount;
+		if (i == last)
+			continue;
+		x[i] = x[last];
+		y[i] = y[last];
+		vx[i] = vx[last];
+		vy[i] = vy[last];
+		life[i] = life[last];
+		mFade[i] = mFade[last];
+		mSize[i] = mSize[last];
+		mColor[i] = mColor[last];
+		mSprite[i] = mSprite[last];
+	}
+}
+
+void ParticleSystem::build(const SDL_Rect& camera)
+{
+	for (int s = 0; s < PARTICLE_SPRITES; s++)
+		mSpriteQuads[s] = 0;
+	if (mCount == 0)
+	{
+		mQuads = 0;
+		mBounds.w = mBounds.h = 0;
+		mBuilds++;
+		return;
+	}
+	//Room for every particle in any sprite, only the first quads are used
+	float* corners[PARTICLE_SPRITES];
+	SDL_Color* colors[PARTICLE_SPRITES];
+	for (int s = 0; s < PARTICLE_SPRITES; s++){
+		size_t grown = mCoords[s].size() / 8;
+		if (grown < (size_t)mCount)
+		{
+			mCorners[s].resize(mCount * 8);
+			mColors[s].resize(mCount * 4);
+			mCoords[s].resize(mCount * 8);
+			float u0 = (float)s / PARTICLE_SPRITES, u1 = (float)(s + 1) / PARTICLE_SPRITES;
+			float corner[8] = { u0, 0, u1, 0, u1, 1, u0, 1 };
+			for (size_t i = grown; i < (size_t)mCount; i++)
+				std::copy(corner, corner + 8, &mCoords[s][i * 8]);
+		}
+		corners[s] = &mCorners[s][0];
+		colors[s] = &mColors[s][0];
+	}
+	int quads[PARTICLE_SPRITES] = { 0 };
+	float left = (float)camera.x, top = (float)camera.y;
+	float right = left + camera.w, bottom = top + camera.h;
+	float minX = (float)camera.w, minY = (float)camera.h, maxX = 0, maxY = 0;
+	int i = 0;
+#ifdef PARTICLES_SSE2
+	//Stores to the vertex buffers could touch the vectors as far as the compiler knows,
+	//so their data is read through locals
+	const float* xs = &mX[0];
+	const float* ys = &mY[0];
+	const float* sizes = &mSize[0];
+	const float* lives = &mLife[0];
+	const float* fades = &mFade[0];
+	const SDL_Color* tints = &mColor[0];
+	const Uint8* sprites = &mSprite[0];
+	int count = mCount;
+	__m128 half = _mm_set1_ps(0.5f);
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 leftV = _mm_set1_ps(left), topV = _mm_set1_ps(top);
+	__m128 rightV = _mm_set1_ps(right), bottomV = _mm_set1_ps(bottom);
+	__m128 lowX = _mm_set1_ps(minX), lowY = _mm_set1_ps(minY);
+	__m128 highX = _mm_setzero_ps(), highY = _mm_setzero_ps();
+	__m128i rgb = _mm_set1_epi32(0x00FFFFFF);
+	//The atlas has a dot and a spark, their places are counted apart so they stay in registers
+	int dots = 0, sparks = 0;
+	for (; i + 4 <= count; i += 4){
+		__m128 size = _mm_loadu_ps(sizes + i);
+		__m128 x0 = _mm_sub_ps(_mm_loadu_ps(xs + i), _mm_mul_ps(size, half));
+		__m128 y0 = _mm_sub_ps(_mm_loadu_ps(ys + i), _mm_mul_ps(size, half));
+		//Same test as below, a quad is kept unless it is wholly off one side
+		__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpnlt_ps(_mm_add_ps(x0, size), leftV), _mm_cmpngt_ps(x0, rightV)), _mm_and_ps(_mm_cmpnlt_ps(_mm_add_ps(y0, size), topV), _mm_cmpngt_ps(y0, bottomV)));
+		int visible = _mm_movemask_ps(inside);
+		if (visible == 0)
+			continue;
+		//Far corners from the moved near ones, the same sums as below
+		x0 = _mm_sub_ps(x0, leftV);
+		y0 = _mm_sub_ps(y0, topV);
+		__m128 x1 = _mm_add_ps(x0, size);
+		__m128 y1 = _mm_add_ps(y0, size);
+		lowX = _mm_min_ps(lowX, _mm_or_ps(_mm_and_ps(inside, x0), _mm_andnot_ps(inside, lowX)));
+		lowY = _mm_min_ps(lowY, _mm_or_ps(_mm_and_ps(inside, y0), _mm_andnot_ps(inside, lowY)));
+		highX = _mm_max_ps(highX, _mm_and_ps(inside, x1));
+		highY = _mm_max_ps(highY, _mm_and_ps(inside, y1));
+		//Fade out over the particle's life, the alpha is the top byte of each colour
+		__m128 fade = _mm_min_ps(_mm_mul_ps(_mm_loadu_ps(lives + i), _mm_loadu_ps(fades + i)), one);
+		__m128i color = _mm_loadu_si128((const __m128i*)(tints + i));
+		__m128 alpha = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(color, 24)), fade);
+		color = _mm_or_si128(_mm_and_si128(color, rgb), _mm_slli_epi32(_mm_cvttps_epi32(alpha), 24));
+		//Corners of each quad clockwise from the top left, two particles per unpack
+		__m128 topLeft = _mm_unpacklo_ps(x0, y0), topRight = _mm_unpacklo_ps(x1, y0);
+		__m128 bottomRight = _mm_unpacklo_ps(x1, y1), bottomLeft = _mm_unpacklo_ps(x0, y1);
+		put_quad(sprites[i], visible & 1, _mm_movelh_ps(topLeft, topRight), _mm_movelh_ps(bottomRight, bottomLeft), _mm_shuffle_epi32(color, _MM_SHUFFLE(0, 0, 0, 0)), corners, colors, dots, sparks);
+		put_quad(sprites[i + 1], visible & 2, _mm_movehl_ps(topRight, topLeft), _mm_movehl_ps(bottomLeft, bottomRight), _mm_shuffle_epi32(color, _MM_SHUFFLE(1, 1, 1, 1)), corners, colors, dots, sparks);
+		topLeft = _mm_unpackhi_ps(x0, y0);
+		topRight = _mm_unpackhi_ps(x1, y0);
+		bottomRight = _mm_unpackhi_ps(x1, y1);
+		bottomLeft = _mm_unpackhi_ps(x0, y1);
+		put_quad(sprites[i + 2], visible & 4, _mm_movelh_ps(topLeft, topRight), _mm_movelh_ps(bottomRight, bottomLeft), _mm_shuffle_epi32(color, _MM_SHUFFLE(2, 2, 2, 2)), corners, colors, dots, sparks);
+		put_quad(sprites[i + 3], visible & 8, _mm_movehl_ps(topRight, topLeft), _mm_movehl_ps(bottomLeft, bottomRight), _mm_shuffle_epi32(color, _MM_SHUFFLE(3, 3, 3, 3)), corners, colors, dots, sparks);
+	}
+	quads[PARTICLE_DOT] = dots;
+	quads[PARTICLE_SPARK] = sparks;
+	float bounds[4][4];
+	_mm_storeu_ps(bounds[0], lowX);
+	_mm_storeu_ps(bounds[1], lowY);
+	_mm_storeu_ps(bounds[2], highX);
+	_mm_storeu_ps(bounds[3], highY);
+	for (int k = 0; k < 4; k++){
+		minX = std::min(minX, bounds[0][k]);
+		minY = std::min(minY, bounds[1][k]);
+		maxX = std::max(maxX, bounds[2][k]);
+		maxY = std::max(maxY, bounds[3][k]);
+	}
+#endif
+	//The rest, or everything without SSE2
+	for (; i < mCount; i++){
+		float size = mSize[i];
+		float x = mX[i] - size / 2, y = mY[i] - size / 2;
+		if (x + size < left || x > right || y + size < top || y > bottom)
+			continue;
+		x -= left;
+		y -= top;
+		minX = std::min(minX, x);
+		minY = std::min(minY, y);
+		maxX = std::max(maxX, x + size);
+		maxY = std::max(maxY, y + size);
+		SDL_Color color = mColor[i];
+		//Fade out over the particle's life
+		float fade = mLife[i] * mFade[i];
+		color.a = (Uint8)(color.a * (fade < 1 ? fade : 1));
+		int sprite = mSprite[i];
+		float* corner = corners[sprite] + quads[sprite] * 8;
+		SDL_Color* tint = colors[sprite] + quads[sprite] * 4;
+		quads[sprite]++;
+		corner[0] = x;			corner[1] = y;
+		corner[2] = x + size;	corner[3] = y;
+		corner[4] = x + size;	corner[5] = y + size;
+		corner[6] = x;			corner[7] = y + size;
+		tint[0] = tint[1] = tint[2] = tint[3] = color;
+	}
+	mQuads = 0;
+	for (int s = 0; s < PARTICLE_SPRITES; s++){
+		mSpriteQuads[s] = quads[s];
+		mQuads += quads[s];
+	}
+	mBounds.x = (int)floorf(minX);
+	mBounds.y = (int)floorf(minY);
+	mBounds.w = mQuads > 0 ? (int)ceilf(maxX) - mBounds.x : 0;
+	mBounds.h = mQuads > 0 ? (int)ceilf(maxY) - mBounds.y : 0;
+	mBuilds++;
+	//Two triangles per quad, shared by the sprites and only ever growing
+	int most = *std::max_element(quads, quads + PARTICLE_SPRITES);
+	for (int i = (int)mIndices.size() / 6; i < most; i++){
+		int first = i * 4;
+		int triangles[6] = { first, first + 1, first + 2, first + 2, first + 3, first };
+		mIndices.insert(mIndices.end(), triangles, triangles + 6);
+	}
+}
+
+#ifdef PARTICLES_SSE2
+inline void ParticleSystem::put_quad(int sprite, int visible, __m128 top, __m128 bottom, __m128i color, float* const corners[], SDL_Color* const colors[], int& dots, int& sparks)
+{
+	bool dot = sprite == PARTICLE_DOT;
+	int place = dot ? dots : sparks;
+	//Every quad in the buffers is 16 byte aligned, they come from new
+	_mm_store_ps(corners[sprite] + place * 8, top);
+	_mm_store_ps(corners[sprite] + place * 8 + 4, bottom);
+	_mm_store_si128((__m128i*)(colors[sprite] + place * 4), color);
+	//A hidden quad is written over by the next one of its sprite
+	int shown = visible != 0;
+	dots += dot ? shown : 0;
+	sparks += dot ? 0 : shown;
+}
+#endif
+
+void ParticleSystem::render(const SDL_Rect& camera)
+{
+	//The compositor draws the actors again for every region it redraws, they are laid out once
+	if (!gCompositor.isActive() || gCompositor.isMeasuring())
+		build(camera);
+	if (gCompositor.isMeasuring())
+	{
+		gCompositor.mark(mBounds, mBuilds);
+		return;
+	}
+	if (mAtlas == NULL)
+		return;
+	for (int s = 0; s < PARTICLE_SPRITES; s++){
+		int quads = mSpriteQuads[s];
+		if (quads > 0)
+			SDL_RenderGeometryRaw(gRenderer, mAtlas, &mCorners[s][0], 2 * sizeof(float), &mColors[s][0], sizeof(SDL_Color), &mCoords[s][0], 2 * sizeof(float), quads * 4, &mIndices[0], quads * 6, sizeof(int));
+	}
+}
+
+int ParticleSystem::getCount() const
+{
+	return mCount;
+}
+
+int ParticleSystem::getQuads() const
+{
+	return mQuads;
+}
+
+const char* ParticleSystem::getPath()
+{
+#ifdef PARTICLES_SSE2
+	return "SSE2";
+#else
+	return "scalar";
+#endif
+}
+
+float ParticleSystem::random()
+{
+	mNoise = mNoise * 1664525 + 1013904223;
+	return (mNoise >> 8) * (1.0f / 16777216);
+}
+
+//Single producer single consumer ring buffer, never blocks or allocates
+template <typename T, unsigned N>
+class SpscQueue{
+public:
+	//Initializes variables
+	SpscQueue();
+
+	//Producer side, returns false when the queue is full
+	bool push(const T& item);
+
+	//Consumer side, returns false when the queue is empty
+	bool pop(T& item);
+private:
+	T mItems[N];
+	//Read and write counters live on separate cache lines
+	alignas(64) std::atomic<unsigned> mHead;
+	alignas(64) std::atomic<unsigned> mTail;
+};
+
+template <typename T, unsigned N>
+SpscQueue<T, N>::SpscQueue()
+{
+	mHead.store(0);
+	mTail.store(0);
+}
+
+template <typename T, unsigned N>
+bool SpscQueue<T, N>::push(const T& item)
+{
+	unsigned tail = mTail.load(std::memory_order_relaxed);
+	if (tail - mHead.load(std::memory_order_acquire) >= N)
+		return false;
+	mItems[tail % N] = item;
+	mTail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
+template <typename T, unsigned N>
+bool SpscQueue<T, N>::pop(T& item)
+{
+	unsigned head = mHead.load(std::memory_order_relaxed);
+	if (head == mTail.load(std::memory_order_acquire))
+		return false;
+	item = mItems[head % N];
+	mHead.store(head + 1, std::memory_order_release);
+	return true;
+}
+
+//Fixed set of threads that run batches of jobs
+class WorkerPool{
+public:
+	//Runs items [begin, end) of a job
+	typedef void (*Job)(void* data, int begin, int end);
+
+	//Initializes variables
+	WorkerPool();
+
+	//Joins the threads
+	~WorkerPool();
+
+	//Starts the threads, 0 starts one per spare core since callers of run() do a share too
+	void start(int threads);
+
+	//Finishes the queued jobs and joins the threads
+	void stop();
+
+	//Queues a job without waiting for it, pending counts it until it is done.
+	//Runs it right away when there are no threads.
+	void submit(Job job, void* data, int begin, int end, std::atomic<int>& pending);
+
+	//Splits items [0, count) into batches and returns once all of them ran
+	void run(Job job, void* data, int count);
+
+	int getThreads() const;
+private:
+	struct Task{
+		Job job;
+		void* data;
+		int begin;
+		int end;
+		std::atomic<int>* pending;
+	};
+
+	//Loop of a worker thread
+	void work();
+
+	//Runs a task and wakes whoever waits for it
+	void finish(const Task& task);
+
+	std::vector<std::thread> mThreads;
+	std::deque<Task> mTasks;
+	std::mutex mLock;
+	//Signalled when a task is queued and when one is done
+	std::condition_variable mWake;
+	std::condition_variable mDone;
+	bool mQuit;
+};
+
+WorkerPool::WorkerPool()
+{
+	mQuit = false;
+}
+
+WorkerPool::~WorkerPool()
+{
+	stop();
+}
+
+void WorkerPool::start(int threads)
+{
+	stop();
+	if (threads <= 0)
+		threads = SDL_GetCPUCount() - 1;
+	mQuit = false;
+	for (int i = 0; i < threads; i++)
+		mThreads.push_back(std::thread(&WorkerPool::work, this));
+}
+
+void WorkerPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		mQuit = true;
+	}
+	mWake.notify_all();
+	for (size_t i = 0; i < mThreads.size(); i++)
+		mThreads[i].join();
+	mThreads.clear();
+}
+
+void WorkerPool::submit(Job job, void* data, int begin, int end, std::atomic<int>& pending)
+{
+	pending++;
+	Task task = { job, data, begin, end, &pending };
+	if (mThreads.empty()){
+		finish(task);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		mTasks.push_back(task);
+	}
+	mWake.notify_one();
+}
+
+void WorkerPool::run(Job job, void* data, int count)
+{
+	if (count <= 0)
+		return;
+	//A few batches per thread even out uneven work, tiny ones are not worth a wake up
+	int batches = (int)mThreads.size() * 4 + 1;
+	int size = (count + batches - 1) / batches;
+	if (size < 256)
+		size = 256;
+	std::atomic<int> pending(0);
+	for (int begin = size; begin < count; begin += size)
+		submit(job, data, begin, begin + size < count ? begin + size : count, pending);
+	//The calling thread takes the first batch and then helps with the queue
+	job(data, 0, size < count ? size : count);
+	std::unique_lock<std::mutex> lock(mLock);
+	while (pending.load() != 0){
+		if (mTasks.empty()){
+			mDone.wait(lock);
+			continue;
+		}
+		Task task = mTasks.front();
+		mTasks.pop_front();
+		lock.unlock();
+		finish(task);
+		lock.lock();
+	}
+}
+
+int WorkerPool::getThreads() const
+{
+	return (int)mThreads.size();
+}
+
+void WorkerPool::work()
+{
+	for (;;){
+		std::unique_lock<std::mutex> lock(mLock);
+		while (mTasks.empty() && !mQuit)
+			mWake.wait(lock);
+		if (mTasks.empty())
+			return;
+		Task task = mTasks.front();
+		mTasks.pop_front();
+		lock.unlock();
+		finish(task);
+	}
+}
+
+void WorkerPool::finish(const Task& task)
+{
+	task.job(task.data, task.begin, task.end);
+	{
+		//Lowered under the lock so a waiter cannot miss the wake up
+		std::lock_guard<std::mutex> lock(mLock);
+		(*task.pending)--;
+	}
+	mDone.notify_all();
+}
+
+enum SoundEffect { SFX_SHOT, SFX_ENEMY_DEATH, SFX_PLAYER_HURT, SFX_COUNT };
+
+//Sound effect player, mixes its own voices on the audio thread after SDL_mixer
+class SoundEffects{
+public:
+	//Initializes variables
+	SoundEffects();
+
+	//Decodes every effect to PCM in the device format and hooks the mixer
+	bool load();
+
+	//Unhooks the mixer and deallocates the effects
+	void free();
+
+	//Queues an effect from the game thread, never blocks on the mixer
+	void play(SoundEffect effect);
+
+	//Prints trigger to audible latency and voice statistics
+	void print_stats();
+private:
+	static const int MAX_VOICES = 8;
+
+	//Play request with its trigger time
+	struct Command{
+		SoundEffect effect;
+		Uint64 triggered;
+	};
+
+	//A playing effect
+	struct Voice{
+		const std::vector<Sint16>* samples;
+		size_t position;
+		int priority;
+	};
+
+	//Loads a WAV file or synthesizes a stand in when it is missing
+	void load_effect(SoundEffect effect, std::string path);
+
+	//Fills an effect with a generated sweep or noise burst
+	void synthesize(SoundEffect effect);
+
+	//SDL_mixer post mix hook
+	static void mix_callback(void* udata, Uint8* stream, int len);
+	void mix(Sint16* stream, int samples);
+
+	//Interleaved PCM in the device format
+	std::vector<Sint16> mSamples[SFX_COUNT];
+	//Device format
+	int mFrequency;
+	int mChannels;
+	//Audio buffer length in sample frames, as the device got it
+	std::atomic<int> mBufferFrames;
+	bool mHooked;
+
+	SpscQueue<Command, 64> mCommands;
+	//Only touched by the audio thread
+	Voice mVoices[MAX_VOICES];
+
+	//Statistics, written by both threads
+	std::atomic<unsigned> mTriggers;
+	std::atomic<unsigned> mDropped;
+	std::atomic<unsigned> mStolen;
+	std::atomic<unsigned> mLatencySum;
+	std::atomic<unsigned> mLatencyMax;
+};
+
+SoundEffects::SoundEffects()
+{
+	//Initialize
+	mFrequency = 0;
+	mChannels = 0;
+	mBufferFrames.store(0);
+	mHooked = false;
+	for (int i = 0; i < MAX_VOICES; i++){
+		mVoices[i].samples = NULL;
+		mVoices[i].position = 0;
+		mVoices[i].priority = 0;
+	}
+	mTriggers.store(0);
+	mDropped.store(0);
+	mStolen.store(0);
+	mLatencySum.store(0);
+	mLatencyMax.store(0);
+}
+
+bool SoundEffects::load()
+{
+	Uint16 format;
+	if (Mix_QuerySpec(&mFrequency, &format, &mChannels) == 0)
+	{
+		printf("Unable to query audio device! SDL_mixer Error: %s\n", Mix_GetError());
+		return false;
+	}
+	if (format != AUDIO_S16SYS)
+	{
+		printf("Sound effects need 16 bit audio, got format 0x%x!\n", format);
+		return false;
+	}
+	//Asked for, the mix callback finds out what the device really uses
+	mBufferFrames.store(AUDIO_BUFFER_FRAMES);
+
+	load_effect(SFX_SHOT, "assets/shot.wav");
+	load_effect(SFX_ENEMY_DEATH, "assets/enemy_death.wav");
+	load_effect(SFX_PLAYER_HURT, "assets/hurt.wav");
+
+	//Effects are read only from now on, safe to share with the audio thread
+	Mix_SetPostMix(mix_callback, this);
+	mHooked = true;
+	return true;
+}
+
+void SoundEffects::load_effect(SoundEffect effect, std::string path)
+{
+	mSamples[effect].clear();
+	SDL_RWops* file = gAssets.open_asset(path);
+	Sint64 bytes = file != NULL ? SDL_RWsize(file) : 0;
+	Uint64 decodeStart = SDL_GetPerformanceCounter();
+	Mix_Chunk* chunk = file != NULL ? Mix_LoadWAV_RW(file, 1) : NULL;
+	if (chunk == NULL)
+	{
+		synthesize(effect);
+		return;
+	}
+	gStartup.asset(path, bytes, SDL_GetPerformanceCounter() - decodeStart, 0);
+	//SDL_mixer already converted the chunk to the device format
+	Sint16* pcm = (Sint16*)chunk->abuf;
+	mSamples[effect].assign(pcm, pcm + chunk->alen / sizeof(Sint16));
+	Mix_FreeChunk(chunk);
+}
+
+void SoundEffects::synthesize(SoundEffect effect)
+{
+	//Short placeholder sounds until real effects are added to assets
+	float seconds = effect == SFX_SHOT ? 0.12f : effect == SFX_ENEMY_DEATH ? 0.25f : 0.3f;
+	int frames = (int)(seconds * mFrequency);
+	mSamples[effect].resize(frames * mChannels);
+	Uint32 noise = 0x12345678;
+	float phase = 0;
+	for (int i = 0; i < frames; i++){
+		float t = (float)i / frames;
+		float envelope = (1 - t) * (1 - t);
+		float value;
+		if (effect == SFX_ENEMY_DEATH){
+			//Decaying white noise
+			noise = noise * 1664525 + 1013904223;
+			value = (float)(noise >> 16) / 32768.0f - 1;
+		}
+		else{
+			//Falling square sweep for the shot, low buzz for the hurt
+			float pitch = effect == SFX_SHOT ? 900 - 600 * t : 160 - 60 * t;
+			phase += pitch / mFrequency;
+			value = phase - (int)phase < 0.5f ? 1.0f : -1.0f;
+		}
+		Sint16 sample = (Sint16)(value * envelope * 9000);
+		for (int c = 0; c < mChannels; c++)
+			mSamples[effect][i * mChannels + c] = sample;
+	}
+}
+
+void SoundEffects::free()
+{
+	//Stop mixing before the samples go away
+	if (mHooked)
+	{
+		Mix_SetPostMix(NULL, NULL);
+		mHooked = false;
+	}
+	for (int i = 0; i < SFX_COUNT; i++)
+		mSamples[i].clear();
+}
+
+void SoundEffects::play(SoundEffect effect)
+{
+	if (!mHooked)
+		return;
+	Command command = { effect, SDL_GetPerformanceCounter() };
+	mTriggers++;
+	if (!mCommands.push(command))
+		mDropped++;
+}
+
+void SoundEffects::mix_callback(void* udata, Uint8* stream, int len)
+{
+	((SoundEffects*)udata)->mix((Sint16*)stream, len / (int)sizeof(Sint16));
+}
+
+void SoundEffects::mix(Sint16* stream, int samples)
+{
+	//Start queued effects, stealing the least important or oldest voice when all are busy
+	Command command;
+	Uint64 now = SDL_GetPerformanceCounter();
+	mBufferFrames.store(samples / mChannels);
+	while (mCommands.pop(command)){
+		const std::vector<Sint16>* sound = &mSamples[command.effect];
+		if (sound->empty())
+			continue;
+		int priority = command.effect == SFX_SHOT ? 0 : 1;
+		int chosen = -1;
+		for (int i = 0; i < MAX_VOICES && chosen < 0; i++){
+			if (mVoices[i].samples == NULL)
+				chosen = i;
+		}
+		if (chosen < 0){
+			for (int i = 0; i < MAX_VOICES; i++){
+				if (mVoices[i].priority > priority)
+					continue;
+				if (chosen < 0 || mVoices[i].priority < mVoices[chosen].priority || (mVoices[i].priority == mVoices[chosen].priority && mVoices[i].position > mVoices[chosen].position))
+					chosen = i;
+			}
+			if (chosen < 0)
+				continue;
+			mStolen++;
+		}
+		mVoices[chosen].samples = sound;
+		mVoices[chosen].position = 0;
+		mVoices[chosen].priority = priority;
+
+		//Time from trigger until the effect lands in a buffer, it is heard after the
+		//buffer ahead of it has played
+		unsigned latency = (unsigned)((now - command.triggered) * 1000000 / SDL_GetPerformanceFrequency());
+		mLatencySum += latency;
+		if (latency > mLatencyMax.load())
+			mLatencyMax.store(latency);
+	}
+
+	//Add every voice to the music with saturation
+	for (int v = 0; v < MAX_VOICES; v++){
+		Voice& voice = mVoices[v];
+		if (voice.samples == NULL)
+			continue;
+		size_t count = voice.samples->size() - voice.position;
+		if (count > (size_t)samples)
+			count = samples;
+		const Sint16* source = &(*voice.samples)[voice.position];
+		for (size_t i = 0; i < count; i++){
+			int sum = stream[i] + source[i];
+			stream[i] = (Sint16)(sum > 32767 ? 32767 : sum < -32768 ? -32768 : sum);
+		}
+		voice.position += count;
+		if (voice.position >= voice.samples->size())
+			voice.samples = NULL;
+	}
+}
+
+void SoundEffects::print_stats()
+{
+	unsigned triggers = mTriggers.load();
+	unsigned played = triggers - mDropped.load();
+	double buffer = mFrequency > 0 ? 1000.0 * mBufferFrames.load() / mFrequency : 0;
+	printf("Sound effects: %u triggered, %u dropped, %u voices stolen\n", triggers, mDropped.load(), mStolen.load());
+	if (played > 0)
+	{
+		double wait = mLatencySum.load() / 1000.0 / played;
+		printf("Trigger to audible: avg %.2f ms, max %.2f ms (avg %.2f ms until mixed, then the %.2f ms audio buffer)\n", wait + buffer, mLatencyMax.load() / 1000.0 + buffer, wait, buffer);
+	}
+}
+
+//Things that happen in the game that other systems react to
+enum GameEventType { EVENT_ENEMY_KILLED, EVENT_PLAYER_HURT, EVENT_SHOT_FIRED, EVENT_LEVEL_WON, EVENT_COUNT };
+
+struct GameEvent{
+	Uint8 type;
+	//Enemy type for EVENT_ENEMY_KILLED and EVENT_PLAYER_HURT
+	char enemy;
+	//Frame it happened on and where in the world
+	Uint32 frame;
+	int x;
+	int y;
+};
+
+//Hands game events from the game thread to consumers running on their own threads.
+//Every consumer has its own ring, so a slow one only loses its own events.
+class EventBus{
+public:
+	//Called on the consumer's thread for every event it subscribed to
+	typedef void (*Handler)(void* data, const GameEvent& event);
+
+	//Initializes variables
+	EventBus();
+
+	//Stops the consumers
+	~EventBus();
+
+	//Adds a consumer of the event types in mask, a bit per GameEventType.
+	//Only before start(), returns -1 when there are too many.
+	int subscribe(const char* name, Handler handler, void* data, Uint32 mask);
+
+	//Starts a thread per consumer
+	void start();
+
+	//Handles the events still queued and joins the threads
+	void stop();
+
+	//Queues an event for every consumer that wants it, only from the game thread.
+	//Never blocks or allocates, an event that does not fit in a ring is dropped and counted.
+	void publish(const GameEvent& event);
+
+	//Events a consumer lost to a full ring
+	Uint32 getDropped(int consumer) const;
+
+	void print_stats();
+private:
+	static const int MAX_CONSUMERS = 4;
+	static const unsigned QUEUE_SIZE = 256;
+
+	struct Consumer{
+		const char* name;
+		Handler handler;
+		void* data;
+		Uint32 mask;
+		SpscQueue<GameEvent, QUEUE_SIZE> queue;
+		//Posted for every queued event
+		SDL_sem* ready;
+		std::thread thread;
+		std::atomic<Uint32> handled;
+		std::atomic<Uint32> dropped;
+	};
+
+	//Loop of a consumer thread
+	void consume(Consumer* consumer);
+
+	Consumer mConsumers[MAX_CONSUMERS];
+	int mCount;
+	bool mRunning;
+	std::atomic<bool> mStopping;
+};
+
+EventBus::EventBus()
+{
+	mCount = 0;
+	mRunning = false;
+	mStopping.store(false);
+}
+
+EventBus::~EventBus()
+{
+	stop();
+}
+
+int EventBus::subscribe(const char* name, Handler handler, void* data, Uint32 mask)
+{
+	if (mRunning || mCount == MAX_CONSUMERS)
+		return -1;
+	Consumer& consumer = mConsumers[mCount];
+	consumer.name = name;
+	consumer.handler = handler;
+	consumer.data = data;
+	consumer.mask = mask;
+	consumer.ready = NULL;
+	consumer.handled.store(0);
+	consumer.dropped.store(0);
+	return mCount++;
+}
+
+void EventBus::start()
+{
+	if (mRunning)
+		return;
+	mStopping.store(false);
+	for (int i = 0; i < mCount; i++){
+		mConsumers[i].ready = SDL_CreateSemaphore(0);
+		mConsumers[i].thread = std::thread(&EventBus::consume, this, &mConsumers[i]);
+	}
+	mRunning = true;
+}
+
+void EventBus::stop()
+{
+	if (!mRunning)
+		return;
+	mStopping.store(true);
+	for (int i = 0; i < mCount; i++){
+		SDL_SemPost(mConsumers[i].ready);
+		mConsumers[i].thread.join();
+		SDL_DestroySemaphore(mConsumers[i].ready);
+		mConsumers[i].ready = NULL;
+	}
+	mRunning = false;
+}
+
+void EventBus::publish(const GameEvent& event)
+{
+	if (!mRunning)
+		return;
+	for (int i = 0; i < mCount; i++){
+		Consumer& consumer = mConsumers[i];
+		if ((consumer.mask & (1u << event.type)) == 0)
+			continue;
+		if (consumer.queue.push(event))
+			SDL_SemPost(consumer.ready);
+		else
+			consumer.dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void EventBus::consume(Consumer* consumer)
+{
+	for (;;){
+		//Checked before draining so events published right before stopping are still handled
+		bool stopping = mStopping.load();
+		GameEvent event;
+		while (consumer->queue.pop(event)){
+			consumer->handler(consumer->data, event);
+			consumer->handled.fetch_add(1, std::memory_order_relaxed);
+		}
+		if (stopping)
+			break;
+		SDL_SemWaitTimeout(consumer->ready, 100);
+	}
+}
+
+Uint32 EventBus::getDropped(int consumer) const
+{
+	return consumer >= 0 && consumer < mCount ? mConsumers[consumer].dropped.load() : 0;
+}
+
+void EventBus::print_stats()
+{
+	printf("Events:\n");
+	for (int i = 0; i < mCount; i++)
+		printf("  %-10s %u handled, %u dropped\n", mConsumers[i].name, mConsumers[i].handled.load(), mConsumers[i].dropped.load());
+}
+
+//Counts the game events and optionally writes them to a CSV file, on the telemetry consumer's thread
+class Telemetry{
+public:
+	//Initializes variables
+	Telemetry();
+
+	//Closes the log
+	~Telemetry();
+
+	//Starts writing every event to a file
+	bool open(std::string path);
+
+	void close();
+
+	//EventBus handler
+	static void record(void* data, const GameEvent& event);
+
+	//Only once the consumer is stopped
+	void print_stats();
+private:
+	FILE* mFile;
+	Uint32 mCounts[EVENT_COUNT];
+};
+
+Telemetry::Telemetry()
+{
+	mFile = NULL;
+	memset(mCounts, 0, sizeof(mCounts));
+}
+
+Telemetry::~Telemetry()
+{
+	close();
+}
+
+bool Telemetry::open(std::string path)
+{
+	close();
+	mFile = fopen(path.c_str(), "w");
+	if (mFile == NULL)
+	{
+		printf("Unable to open telemetry log %s!\n", path.c_str());
+		return false;
+	}
+	fprintf(mFile, "frame,event,enemy,x,y\n");
+	return true;
+}
+
+void Telemetry::close()
+{
+	if (mFile != NULL)
+	{
+		fclose(mFile);
+		mFile = NULL;
+	}
+}
+
+void Telemetry::record(void* data, const GameEvent& event)
+{
+	static const char* names[] = { "enemy_killed", "player_hurt", "shot_fired", "level_won" };
+	Telemetry* telemetry = (Telemetry*)data;
+	telemetry->mCounts[event.type]++;
+	if (telemetry->mFile != NULL)
+		fprintf(telemetry->mFile, "%u,%s,%c,%d,%d\n", event.frame, names[event.type], event.enemy != 0 ? event.enemy : '-', event.x, event.y);
+}
+
+void Telemetry::print_stats()
+{
+	printf("Telemetry: %u kills, %u hits taken, %u shots, %u wins\n", mCounts[EVENT_ENEMY_KILLED], mCounts[EVENT_PLAYER_HURT], mCounts[EVENT_SHOT_FIRED], mCounts[EVENT_LEVEL_WON]);
+}
+
+//One finished run, the record layout of the score log and index
+struct ScoreRecord{
+	Uint32 score;
+	Uint32 kills;
+	//Milliseconds played
+	Uint32 time;
+	//Furthest the player got from the start, in pixels
+	Uint32 distance;
+	//Seconds since 1970
+	Sint64 date;
+	//Position in the log, earlier runs win ties
+	Uint32 sequence;
+	Uint32 checksum;
+};
+
+//Number of runs the index keeps
+const int TOP_SCORES = 10;
+
+//High scores kept in an append only log of checksummed records, with the best runs
+//compacted into a small index that is memory mapped and read in place. Runs are
+//written by a background thread so recording one never waits for the disk.
+class ScoreStore{
+public:
+	//Initializes variables
+	ScoreStore();
+
+	//Stops the writer
+	~ScoreStore();
+
+	//Opens the log and index named after path and starts the writer. A missing or
+	//stale index is brought up to date from the log on the writer thread.
+	bool open(std::string path);
+
+	//Writes the runs still queued and stops the writer
+	void close();
+
+	//Queues a run for writing, never touches the disk
+	void submit(const ScoreRecord& run);
+
+	//Copies the best runs, best first
+	void top(std::vector<ScoreRecord>& runs);
+
+	//Score of a run
+	static Uint32 compute(int kills, double seconds, int distance, bool won);
+private:
+	//On disk layout of the index, followed by its runs best first
+	struct IndexHeader{
+		char magic[4];
+		Uint32 version;
+		Uint32 count;
+		Uint32 checksum;
+		//Log records the index accounts for
+		Uint64 records;
+	};
+
+	//Writer thread
+	void write();
+	//Rebuilds the best runs from the index and the log records it does not cover
+	void recover();
+	//Appends runs to the log and numbers them
+	bool append(std::vector<ScoreRecord>& runs);
+	//Keeps the run if it is one of the best
+	void insert(const ScoreRecord& run);
+	//Replaces the index with the best runs
+	bool write_index();
+	bool map_index();
+	void unmap_index();
+
+	static bool better(const ScoreRecord& a, const ScoreRecord& b);
+	static Uint32 checksum(const ScoreRecord& run);
+	//Makes sure what was written survives a crash
+	static bool sync(FILE* file);
+
+	std::string mLogPath;
+	std::string mIndexPath;
+	FILE* mLog;
+	//Valid records in the log
+	Uint64 mRecords;
+	//Best runs, a heap with the worst of them on top. Only the writer touches it.
+	std::vector<ScoreRecord> mBest;
+
+	//Mapped index, guarded by mLock
+	const Uint8* mIndex;
+	size_t mIndexSize;
+#ifdef _WIN32
+	HANDLE mIndexFile;
+	HANDLE mIndexMapping;
+#endif
+
+	std::thread mWriter;
+	std::mutex mLock;
+	std::condition_variable mWake;
+	std::deque<ScoreRecord> mPending;
+	bool mStopping;
+};
+
+ScoreStore::ScoreStore()
+{
+	mLog = NULL;
+	mRecords = 0;
+	mIndex = NULL;
+	mIndexSize = 0;
+#ifdef _WIN32
+	mIndexFile = INVALID_HANDLE_VALUE;
+	mIndexMapping = NULL;
+#endif
+	mStopping = false;
+}
+
+ScoreStore::~ScoreStore()
+{
+	close();
+}
+
+bool ScoreStore::open(std::string path)
+{
+	close();
+	mLogPath = path + ".log";
+	mIndexPath = path + ".idx";
+	//Records are written in place after the last whole one, over a record torn by a crash
+	mLog = fopen(mLogPath.c_str(), "r+b");
+	if (mLog == NULL)
+		mLog = fopen(mLogPath.c_str(), "w+b");
+	if (mLog == NULL)
+	{
+		printf("Unable to open score log %s!\n", mLogPath.c_str());
+		return false;
+	}
+	fseek(mLog, 0, SEEK_END);
+	mRecords = (Uint64)ftell(mLog) / sizeof(ScoreRecord);
+	//The screen reads the old index, if any, until the writer has caught up
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		map_index();
+	}
+	mBest.clear();
+	mStopping = false;
+	mWriter = std::thread(&ScoreStore::write, this);
+	return true;
+}
+
+void ScoreStore::close()
+{
+	if (mWriter.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mLock);
+			mStopping = true;
+		}
+		mWake.notify_one();
+		mWriter.join();
+	}
+	if (mLog != NULL)
+	{
+		fclose(mLog);
+		mLog = NULL;
+	}
+	std::lock_guard<std::mutex> lock(mLock);
+	unmap_index();
+}
+
+void ScoreStore::submit(const ScoreRecord& run)
+{
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		mPending.push_back(run);
+	}
+	mWake.notify_one();
+}
+
+void ScoreStore::top(std::vector<ScoreRecord>& runs)
+{
+	runs.clear();
+	std::lock_guard<std::mutex> lock(mLock);
+	if (mIndex == NULL)
+		return;
+	const IndexHeader* header = (const IndexHeader*)mIndex;
+	const ScoreRecord* best = (const ScoreRecord*)(mIndex + sizeof(IndexHeader));
+	runs.assign(best, best + header->count);
+}
+
+Uint32 ScoreStore::compute(int kills, double seconds, int distance, bool won)
+{
+	int score = kills * 100 + (distance > 0 ? distance / 10 : 0);
+	//Winning is worth more the faster it was done
+	if (won)
+		score += 1000 + (seconds < 180 ? (int)(180 - seconds) * 10 : 0);
+	return (Uint32)score;
+}
+
+void ScoreStore::write()
+{
+	recover();
+	std::unique_lock<std::mutex> lock(mLock);
+	for (;;){
+		while (mPending.empty() && !mStopping)
+			mWake.wait(lock);
+		if (mPending.empty())
+			break;
+		//Everything queued goes to disk together, one sync for the lot
+		std::deque<ScoreRecord> queued;
+		queued.swap(mPending);
+		lock.unlock();
+		std::vector<ScoreRecord> runs(queued.begin(), queued.end());
+		if (append(runs))
+		{
+			for (size_t i = 0; i < runs.size(); i++)
+				insert(runs[i]);
+			write_index();
+		}
+		lock.lock();
+	}
+}
+
+void ScoreStore::recover()
+{
+	//Start from the index when it checks out and does not claim more than the log holds
+	Uint64 covered = 0;
+	bool valid = false;
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		if (mIndex != NULL)
+		{
+			const IndexHeader* header = (const IndexHeader*)mIndex;
+			const ScoreRecord* best = (const ScoreRecord*)(mIndex + sizeof(IndexHeader));
+			valid = header->records <= mRecords;
+			for (Uint32 i = 0; valid && i < header->count; i++)
+				valid = checksum(best[i]) == best[i].checksum && best[i].sequence < mRecords;
+			if (valid)
+			{
+				covered = header->records;
+				for (Uint32 i = 0; i < header->count; i++)
+					insert(best[i]);
+			}
+		}
+	}
+	if (valid && covered == mRecords)
+		return;
+	if (!valid && mRecords > 0)
+		printf("Rebuilding high score index from %llu runs\n", (unsigned long long)mRecords);
+	//Replay the runs the index has not seen, damaged records are skipped
+	std::vector<ScoreRecord> chunk(4096);
+	fseek(mLog, (long)(covered * sizeof(ScoreRecord)), SEEK_SET);
+	Uint64 damaged = 0;
+	while (covered < mRecords){
+		size_t wanted = (size_t)std::min<Uint64>(chunk.size(), mRecords - covered);
+		size_t read = fread(&chunk[0], sizeof(ScoreRecord), wanted, mLog);
+		for (size_t i = 0; i < read; i++){
+			if (checksum(chunk[i]) == chunk[i].checksum && chunk[i].sequence == covered + i)
+				insert(chunk[i]);
+			else
+				damaged++;
+		}
+		covered += read;
+		if (read < wanted)
+			break;
+	}
+	if (damaged > 0)
+		printf("Skipped %llu damaged high score records\n", (unsigned long long)damaged);
+	write_index();
+}
+
+bool ScoreStore::append(std::vector<ScoreRecord>& runs)
+{
+	for (size_t i = 0; i < runs.size(); i++){
+		runs[i].sequence = (Uint32)(mRecords + i);
+		runs[i].checksum = checksum(runs[i]);
+	}
+	fseek(mLog, (long)(mRecords * sizeof(ScoreRecord)), SEEK_SET);
+	if (fwrite(&runs[0], sizeof(ScoreRecord), runs.size(), mLog) != runs.size() || !sync(mLog))
+	{
+		printf("Unable to write score log %s!\n", mLogPath.c_str());
+		return false;
+	}
+	mRecords += runs.size();
+	return true;
+}
+
+void ScoreStore::insert(const ScoreRecord& run)
+{
+	if ((int)mBest.size() < TOP_SCORES)
+	{
+		mBest.push_back(run);
+		std::push_heap(mBest.begin(), mBest.end(), better);
+	}
+	else if (better(run, mBest.front()))
+	{
+		//Drop the worst of the best
+		std::pop_heap(mBest.begin(), mBest.end(), better);
+		mBest.back() = run;
+		std::push_heap(mBest.begin(), mBest.end(), better);
+	}
+}
+
+bool ScoreStore::write_index()
+{
+	std::vector<ScoreRecord> best(mBest);
+	std::sort(best.begin(), best.end(), better);
+	IndexHeader header;
+	memcpy(header.magic, "SRHS", 4);
+	header.version = 1;
+	header.count = (Uint32)best.size();
+	header.records = mRecords;
+	header.checksum = fnv1a(best.empty() ? NULL : &best[0], best.size() * sizeof(ScoreRecord));
+
+	//Written next to the old index and swapped in, so a crash leaves one or the other
+	std::string temp = mIndexPath + ".tmp";
+	FILE* out = fopen(temp.c_str(), "wb");
+	if (out == NULL)
+	{
+		printf("Unable to write high score index %s!\n", temp.c_str());
+		return false;
+	}
+	bool success = fwrite(&header, sizeof(header), 1, out) == 1;
+	if (success && !best.empty())
+		success = fwrite(&best[0], sizeof(ScoreRecord), best.size(), out) == best.size();
+	success = sync(out) && success;
+	fclose(out);
+	if (!success)
+	{
+		printf("Unable to write high score index %s!\n", temp.c_str());
+		return false;
+	}
+#ifdef _WIN32
+	//A mapped file can't be replaced, the old view goes first
+	std::lock_guard<std::mutex> lock(mLock);
+	unmap_index();
+	success = MoveFileExA(temp.c_str(), mIndexPath.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	success = rename(temp.c_str(), mIndexPath.c_str()) == 0;
+	std::lock_guard<std::mutex> lock(mLock);
+	unmap_index();
+#endif
+	if (!success)
+		printf("Unable to replace high score index %s!\n", mIndexPath.c_str());
+	map_index();
+	return success;
+}
+
+bool ScoreStore::map_index()
+{
+	//Same mapping as the asset pack, the index is only ever replaced whole
+#ifdef _WIN32
+	mIndexFile = CreateFileA(mIndexPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mIndexFile == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	GetFileSizeEx(mIndexFile, &size);
+	mIndexSize = (size_t)size.QuadPart;
+	mIndexMapping = CreateFileMappingA(mIndexFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mIndexMapping != NULL)
+		mIndex = (const Uint8*)MapViewOfFile(mIndexMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	int file = ::open(mIndexPath.c_str(), O_RDONLY);
+	if (file < 0)
+		return false;
+	struct stat info;
+	if (fstat(file, &info) == 0 && info.st_size > 0)
+	{
+		mIndexSize = (size_t)info.st_size;
+		void* data = mmap(NULL, mIndexSize, PROT_READ, MAP_SHARED, file, 0);
+		if (data != MAP_FAILED)
+			mIndex = (const Uint8*)data;
+	}
+	::close(file);
+#endif
+	if (mIndex == NULL)
+	{
+		unmap_index();
+		return false;
+	}
+	//A damaged index is as good as none, the log is the truth
+	const IndexHeader* header = (const IndexHeader*)mIndex;
+	if (mIndexSize < sizeof(IndexHeader) || memcmp(header->magic, "SRHS", 4) != 0 || header->version != 1 || header->count > TOP_SCORES
+		|| (mIndexSize - sizeof(IndexHeader)) / sizeof(ScoreRecord) < header->count
+		|| fnv1a(mIndex + sizeof(IndexHeader), header->count * sizeof(ScoreRecord)) != header->checksum)
+	{
+		printf("High score index %s is damaged!\n", mIndexPath.c_str());
+		unmap_index();
+		return false;
+	}
+	return true;
+}
+
+void ScoreStore::unmap_index()
+{
+	if (mIndex != NULL)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(mIndex);
+#else
+		munmap((void*)mIndex, mIndexSize);
+#endif
+		mIndex = NULL;
+		mIndexSize = 0;
+	}
+#ifdef _WIN32
+	if (mIndexMapping != NULL)
+	{
+		CloseHandle(mIndexMapping);
+		mIndexMapping = NULL;
+	}
+	if (mIndexFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(mIndexFile);
+		mIndexFile = INVALID_HANDLE_VALUE;
+	}
+#endif
+}
+
+bool ScoreStore::better(const ScoreRecord& a, const ScoreRecord& b)
+{
+	if (a.score != b.score)
+		return a.score > b.score;
+	return a.sequence < b.sequence;
+}
+
+Uint32 ScoreStore::checksum(const ScoreRecord& run)
+{
+	//Everything but the checksum itself
+	return fnv1a(&run, offsetof(ScoreRecord, checksum));
+}
+
+bool ScoreStore::sync(FILE* file)
+{
+	if (fflush(file) != 0)
+		return false;
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+//Ways a capture can be written
+enum CaptureFormat { CAPTURE_NONE, CAPTURE_YUV, CAPTURE_PNG, CAPTURE_FFMPEG };
+
+//Records the frames the game presents without waiting for the GPU or the disk.
+//Frames are drawn into an offscreen target, read back a frame late into a ring of
+//staging buffers and written out by an encoder thread.
+class FrameCapture{
+public:
+	//Initializes variables
+	FrameCapture();
+
+	//Stops recording
+	~FrameCapture();
+
+	//Parses "yuv", "png" or "ffmpeg", CAPTURE_NONE for anything else
+	static CaptureFormat parse_format(const char* name);
+
+	//Starts recording. yuv appends raw I420 frames to one file, png writes a numbered
+	//file per frame after path and ffmpeg pipes to a local ffmpeg that encodes to path.
+	bool start(CaptureFormat format, std::string path);
+
+	//Writes the frames still queued and stops the encoder
+	void stop();
+
+	//Directs the drawing of a frame to the offscreen target while recording
+	void begin_frame();
+
+	//Presents the frame and, while recording, queues the previous one for the encoder.
+	//Call instead of SDL_RenderPresent.
+	void end_frame();
+
+	bool isRecording() const;
+
+	void print_stats();
+private:
+	//Offscreen targets drawn in turn and staging buffers
+	static const int TARGETS = 2;
+	static const int STAGING = 4;
+
+	//Copies a drawn target into a free staging buffer, drops it when there is none
+	void read_back(SDL_Texture* target);
+
+	//Loop of the encoder thread
+	void encode();
+
+	//Writes one frame of RGBA pixels, false when the output failed
+	bool write(const Uint8* pixels);
+
+	//Quotes a path as a single argument of the command line popen runs, false
+	//when the shell can't be kept from reading something in it
+	static bool quote_path(const std::string& path, std::string& quoted);
+
+	CaptureFormat mFormat;
+	std::string mPath;
+	SDL_Texture* mTargets[TARGETS];
+	//Frames drawn so far
+	int mFrame;
+	std::vector<Uint8> mStaging[STAGING];
+	//Indices of the staging buffers, free ones go to the game thread and full ones to the encoder
+	SpscQueue<int, STAGING> mFree;
+	SpscQueue<int, STAGING> mFull;
+	//Free buffer taken by a read back that failed
+	int mSpare;
+	//Posted for every full buffer
+	SDL_sem* mReady;
+	std::thread mEncoder;
+	std::atomic<bool> mStopping;
+	//Set by the encoder when a write failed, the game thread then stops recording
+	std::atomic<bool> mFailed;
+	//Output of the yuv and ffmpeg formats
+	FILE* mFile;
+#ifndef _WIN32
+	//SIGPIPE handler to put back when ffmpeg is closed
+	void (*mPipeHandler)(int);
+#endif
+	//I420 frame being converted by the encoder
+	std::vector<Uint8> mYuv;
+
+	//Statistics
+	int mRead;
+	int mDropped;
+	Uint64 mReadTime;
+	//Written by the encoder thread, read after it is joined
+	int mWritten;
+	Uint64 mEncodeTime;
+};
+
+FrameCapture::FrameCapture()
+{
+	mFormat = CAPTURE_NONE;
+	for (int i = 0; i < TARGETS; i++)
+		mTargets[i] = NULL;
+	mFrame = 0;
+	mSpare = -1;
+	mReady = NULL;
+	mStopping.store(false);
+	mFailed.store(false);
+	mFile = NULL;
+#ifndef _WIN32
+	mPipeHandler = SIG_DFL;
+#endif
+	mRead = 0;
+	mDropped = 0;
+	mReadTime = 0;
+	mWritten = 0;
+	mEncodeTime = 0;
+}
+
+FrameCapture::~FrameCapture()
+{
+	stop();
+}
+
+CaptureFormat FrameCapture::parse_format(const char* name)
+{
+	if (strcmp(name, "yuv") == 0)
+		return CAPTURE_YUV;
+	if (strcmp(name, "png") == 0)
+		return CAPTURE_PNG;
+	if (strcmp(name, "ffmpeg") == 0)
+		return CAPTURE_FFMPEG;
+	return CAPTURE_NONE;
+}
+
+bool FrameCapture::start(CaptureFormat format, std::string path)
+{
+	stop();
+	for (int i = 0; i < TARGETS; i++){
+		mTargets[i] = SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, SCREEN_WIDTH, SCREEN_HEIGHT);
+		if (mTargets[i] == NULL)
+		{
+			printf("Unable to create capture target! SDL Error: %s\n", SDL_GetError());
+			stop();
+			return false;
+		}
+	}
+	if (format == CAPTURE_YUV)
+		mFile = fopen(path.c_str(), "wb");
+	else if (format == CAPTURE_FFMPEG){
+		std::string quoted;
+		if (!quote_path(path, quoted))
+		{
+			printf("Capture path %s can't be passed to ffmpeg!\n", path.c_str());
+			stop();
+			return false;
+		}
+		char options[128];
+		snprintf(options, sizeof(options), "ffmpeg -loglevel error -y -f rawvideo -pix_fmt rgba -s %dx%d -r 60 -i - -pix_fmt yuv420p ", SCREEN_WIDTH, SCREEN_HEIGHT);
+		std::string command = options + quoted;
+#ifdef _WIN32
+		mFile = _popen(command.c_str(), "wb");
+#else
+		//A missing or failed ffmpeg must not kill the game, its writes fail instead
+		mPipeHandler = signal(SIGPIPE, SIG_IGN);
+		mFile = popen(command.c_str(), "w");
+		if (mFile == NULL)
+			signal(SIGPIPE, mPipeHandler);
+#endif
+	}
+	if (format != CAPTURE_PNG && mFile == NULL)
+	{
+		printf("Unable to open capture output %s!\n", path.c_str());
+		stop();
+		return false;
+	}
+	mFormat = format;
+	mPath = path;
+	mFrame = 0;
+	mSpare = -1;
+	mRead = 0;
+	mDropped = 0;
+	mReadTime = 0;
+	mWritten = 0;
+	mEncodeTime = 0;
+	for (int i = 0; i < STAGING; i++){
+		mStaging[i].resize(SCREEN_WIDTH * SCREEN_HEIGHT * 4);
+		mFree.push(i);
+	}
+	mReady = SDL_CreateSemaphore(0);
+	mStopping.store(false);
+	mFailed.store(false);
+	mEncoder = std::thread(&FrameCapture::encode, this);
+	return true;
+}
+
+void FrameCapture::stop()
+{
+	if (mFormat != CAPTURE_NONE){
+		//The last frame has not been read back yet
+		if (mFrame > 0)
+			read_back(mTargets[(mFrame - 1) % TARGETS]);
+		mStopping.store(true);
+		SDL_SemPost(mReady);
+		mEncoder.join();
+		SDL_DestroySemaphore(mReady);
+		mReady = NULL;
+		//Return the buffers so the queues are empty for the next start, a failed
+		//encoder leaves full ones behind
+		int buffer;
+		while (mFree.pop(buffer));
+		while (mFull.pop(buffer));
+	}
+	if (mFile != NULL){
+		if (mFormat == CAPTURE_FFMPEG){
+#ifdef _WIN32
+			int status = _pclose(mFile);
+#else
+			int status = pclose(mFile);
+			signal(SIGPIPE, mPipeHandler);
+#endif
+			if (status != 0)
+				printf("ffmpeg failed to encode %s!\n", mPath.c_str());
+		}
+		else if (fclose(mFile) != 0)
+			printf("Unable to finish capture output %s! %s\n", mPath.c_str(), strerror(errno));
+		mFile = NULL;
+	}
+	for (int i = 0; i < TARGETS; i++){
+		if (mTargets[i] != NULL)
+			SDL_DestroyTexture(mTargets[i]);
+		mTargets[i] = NULL;
+	}
+	mFormat = CAPTURE_NONE;
+}
+
+void FrameCapture::begin_frame()
+{
+	if (mFormat != CAPTURE_NONE)
+		SDL_SetRenderTarget(gRenderer, mTargets[mFrame % TARGETS]);
+}
+
+void FrameCapture::end_frame()
+{
+	if (mFormat == CAPTURE_NONE){
+		SDL_RenderPresent(gRenderer);
+		return;
+	}
+	SDL_SetRenderTarget(gRenderer, NULL);
+	SDL_RenderCopy(gRenderer, mTargets[mFrame % TARGETS], NULL, NULL);
+	SDL_RenderPresent(gRenderer);
+	//SDL has no asynchronous read back. The frame before this one finished drawing
+	//during the present, so reading it does not wait for the frame just submitted.
+	if (mFrame > 0)
+		read_back(mTargets[(mFrame - 1) % TARGETS]);
+	mFrame++;
+	if (mFailed.load())
+	{
+		printf("Capture to %s stopped after %d frames\n", mPath.c_str(), mWritten);
+		stop();
+	}
+}
+
+void FrameCapture::read_back(SDL_Texture* target)
+{
+	int buffer = mSpare;
+	mSpare = -1;
+	//The encoder is behind, drop the frame rather than wait for it
+	if (buffer < 0 && !mFree.pop(buffer)){
+		mDropped++;
+		return;
+	}
+	Uint64 start = SDL_GetPerformanceCounter();
+	SDL_SetRenderTarget(gRenderer, target);
+	bool read = SDL_RenderReadPixels(gRenderer, NULL, SDL_PIXELFORMAT_RGBA32, &mStaging[buffer][0], SCREEN_WIDTH * 4) == 0;
+	SDL_SetRenderTarget(gRenderer, NULL);
+	mReadTime += SDL_GetPerformanceCounter() - start;
+	if (!read){
+		mSpare = buffer;
+		mDropped++;
+		return;
+	}
+	mRead++;
+	mFull.push(buffer);
+	SDL_SemPost(mReady);
+}
+
+bool FrameCapture::isRecording() const
+{
+	return mFormat != CAPTURE_NONE;
+}
+
+void FrameCapture::encode()
+{
+	for (;;){
+		//Checked before draining so frames queued right before stopping are still written
+		bool stopping = mStopping.load();
+		int buffer;
+		while (mFull.pop(buffer)){
+			Uint64 start = SDL_GetPerformanceCounter();
+			bool written = write(&mStaging[buffer][0]);
+			mEncodeTime += SDL_GetPerformanceCounter() - start;
+			mFree.push(buffer);
+			//The frames behind a failed one are left for stop
+			if (!written){
+				mFailed.store(true);
+				return;
+			}
+			mWritten++;
+		}
+		if (stopping)
+			break;
+		SDL_SemWaitTimeout(mReady, 100);
+	}
+}
+
+bool FrameCapture::write(const Uint8* pixels)
+{
+	if (mFormat == CAPTURE_PNG){
+		char name[512];
+		snprintf(name, sizeof(name), "%s%05d.png", mPath.c_str(), mWritten);
+		SDL_Surface* frame = SDL_CreateRGBSurfaceWithFormatFrom((void*)pixels, SCREEN_WIDTH, SCREEN_HEIGHT, 32, SCREEN_WIDTH * 4, SDL_PIXELFORMAT_RGBA32);
+		bool saved = frame != NULL && IMG_SavePNG(frame, name) == 0;
+		if (!saved)
+			printf("Unable to save capture frame %s! SDL_image Error: %s\n", name, IMG_GetError());
+		if (frame != NULL)
+			SDL_FreeSurface(frame);
+		return saved;
+	}
+	if (mFormat == CAPTURE_FFMPEG){
+		size_t size = SCREEN_WIDTH * SCREEN_HEIGHT * 4;
+		if (fwrite(pixels, 1, size, mFile) != size)
+		{
+			printf("Unable to write capture frame to ffmpeg! %s\n", strerror(errno));
+			return false;
+		}
+		return true;
+	}
+	//BT.601 studio range I420, chroma averaged over 2x2 pixels
+	const int w = SCREEN_WIDTH, h = SCREEN_HEIGHT;
+	mYuv.resize(w * h * 3 / 2);
+	Uint8* luma = &mYuv[0];
+	Uint8* u = luma + w * h;
+	Uint8* v = u + (w / 2) * (h / 2);
+	for (int y = 0; y < h; y++){
+		const Uint8* p = pixels + y * w * 4;
+		for (int x = 0; x < w; x++, p += 4)
+			luma[y * w + x] = (Uint8)(((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16);
+	}
+	for (int y = 0; y < h / 2; y++){
+		const Uint8* top = pixels + y * 2 * w * 4;
+		const Uint8* bottom = top + w * 4;
+		for (int x = 0; x < w / 2; x++, top += 8, bottom += 8){
+			int r = (top[0] + top[4] + bottom[0] + bottom[4] + 2) >> 2;
+			int g = (top[1] + top[5] + bottom[1] + bottom[5] + 2) >> 2;
+			int b = (top[2] + top[6] + bottom[2] + bottom[6] + 2) >> 2;
+			u[y * (w / 2) + x] = (Uint8)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+			v[y * (w / 2) + x] = (Uint8)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+		}
+	}
+	if (fwrite(&mYuv[0], 1, mYuv.size(), mFile) != mYuv.size())
+	{
+		printf("Unable to write capture frame to %s! %s\n", mPath.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool FrameCapture::quote_path(const std::string& path, std::string& quoted)
+{
+	if (path.empty())
+		return false;
+	//ffmpeg takes a leading dash for an option
+	std::string name = path[0] == '-' ? "./" + path : path;
+#ifdef _WIN32
+	//cmd.exe expands %VAR% even inside quotes and has no way to escape a quote
+	if (name.find_first_of("\"%") != std::string::npos)
+		return false;
+	quoted = "\"" + name + "\"";
+#else
+	//Nothing is special inside single quotes, a quote itself is closed, escaped and reopened
+	quoted = "'";
+	for (size_t i = 0; i < name.size(); i++){
+		if (name[i] == '\'')
+			quoted += "'\\''";
+		else
+			quoted += name[i];
+	}
+	quoted += "'";
+#endif
+	return true;
+}
+
+void FrameCapture::print_stats()
+{
+	if (mFrame == 0)
+		return;
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	printf("Capture: %d frames drawn, %d written, %d dropped\n", mFrame, mWritten, mDropped);
+	printf("  read back avg %.3f ms, encode avg %.3f ms per frame\n", mRead > 0 ? mReadTime / frequency / mRead * 1000 : 0, mWritten > 0 ? mEncodeTime / frequency / mWritten * 1000 : 0);
+}
+
+//Draws the scene at a lower resolution when frames take too long and scales it up
+//to the window. Draw calls keep using window coordinates at every scale.
+class ResolutionScaler{
+public:
+	//Initializes variables
+	ResolutionScaler();
+
+	//Deallocates the target
+	~ResolutionScaler();
+
+	//Creates the offscreen target and aims for the refresh rate of the window
+	bool init();
+
+	//Deallocates the target
+	void free();
+
+	//Directs drawing to the offscreen target at the current scale, does nothing at full scale
+	void begin_frame();
+
+	//Scales the offscreen target up to the target that was in use before begin_frame()
+	void end_frame();
+
+	//Feeds the controller with the time between frames and the part of it spent before
+	//presenting, both in seconds, and changes the scale when needed
+	void update(double frameTime, double busyTime);
+
+	//Percentage of the window resolution the scene is drawn at
+	int getScale() const;
+private:
+	//Range and step of the scale in percent
+	static const int MIN_SCALE = 50;
+	static const int MAX_SCALE = 100;
+	static const int STEP = 5;
+	//Frames to wait after a change before judging the new scale
+	static const int SETTLE_FRAMES = 30;
+	//Frames within budget after which a failed scale is tried again
+	static const int RETRY_FRAMES = 600;
+
+	//Applies a new scale and logs it
+	void change(int scale, const char* reason);
+
+	SDL_Texture* mTarget;
+	//Target to draw the scaled frame to
+	SDL_Texture* mPrevious;
+	//Size the frame is drawn at in the target
+	int mWidth;
+	int mHeight;
+	int mScale;
+	//Seconds a frame may take
+	double mBudget;
+	//Smoothed frame and busy times
+	double mFrameTime;
+	double mBusyTime;
+	//Lowest scale that missed the budget, scaling up stops below it
+	int mCeiling;
+	int mSettle;
+	int mStable;
+	bool mDrawing;
+};
+
+ResolutionScaler::ResolutionScaler()
+{
+	mTarget = NULL;
+	mPrevious = NULL;
+	mWidth = SCREEN_WIDTH;
+	mHeight = SCREEN_HEIGHT;
+	mScale = MAX_SCALE;
+	mBudget = 1.0 / 60;
+	mFrameTime = 0;
+	mBusyTime = 0;
+	mCeiling = MAX_SCALE + STEP;
+	mSettle = SETTLE_FRAMES;
+	mStable = 0;
+	mDrawing = false;
+}
+
+ResolutionScaler::~ResolutionScaler()
+{
+	free();
+}
+
+bool ResolutionScaler::init()
+{
+	free();
+	SDL_DisplayMode mode;
+	if (SDL_GetWindowDisplayMode(gWindow, &mode) == 0 && mode.refresh_rate > 0)
+		mBudget = 1.0 / mode.refresh_rate;
+	mTarget = SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, SCREEN_WIDTH, SCREEN_HEIGHT);
+	if (mTarget == NULL)
+	{
+		printf("Unable to create scaling target, drawing at full resolution! SDL Error: %s\n", SDL_GetError());
+		return false;
+	}
+	return true;
+}
+
+void ResolutionScaler::free()
+{
+	if (mTarget != NULL)
+	{
+		SDL_DestroyTexture(mTarget);
+		mTarget = NULL;
+	}
+	mScale = MAX_SCALE;
+	mWidth = SCREEN_WIDTH;
+	mHeight = SCREEN_HEIGHT;
+}
+
+void ResolutionScaler::begin_frame()
+{
+	//Full scale draws straight to the screen, an extra copy would only cost time
+	mDrawing = mTarget != NULL && mScale < MAX_SCALE;
+	if (!mDrawing)
+		return;
+	mPrevious = SDL_GetRenderTarget(gRenderer);
+	SDL_SetRenderTarget(gRenderer, mTarget);
+	//Window coordinates land in the top left mWidth x mHeight of the target
+	SDL_RenderSetScale(gRenderer, (float)mWidth / SCREEN_WIDTH, (float)mHeight / SCREEN_HEIGHT);
+}
+
+void ResolutionScaler::end_frame()
+{
+	if (!mDrawing)
+		return;
+	mDrawing = false;
+	//Switching targets resets the scale
+	SDL_SetRenderTarget(gRenderer, mPrevious);
+	SDL_Rect drawn = { 0, 0, mWidth, mHeight };
+	SDL_RenderCopy(gRenderer, mTarget, &drawn, NULL);
+}
+
+void ResolutionScaler::update(double frameTime, double busyTime)
+{
+	if (mTarget == NULL || frameTime <= 0 || frameTime > 0.25)
+		return;
+	mFrameTime = mFrameTime == 0 ? frameTime : mFrameTime * 0.9 + frameTime * 0.1;
+	mBusyTime = mBusyTime == 0 ? busyTime : mBusyTime * 0.9 + busyTime * 0.1;
+	if (mSettle > 0){
+		mSettle--;
+		return;
+	}
+	//Missed frames show up as frame times past the budget, even with vsync
+	if (mFrameTime > mBudget * 1.1){
+		mStable = 0;
+		if (mScale <= MIN_SCALE)
+			return;
+		mCeiling = mScale;
+		//The cost of a frame grows with its pixels, the square of the scale
+		int scale = (int)(mScale * sqrt(mBudget / mFrameTime)) / STEP * STEP;
+		change(scale < mScale - STEP ? scale : mScale - STEP, "over budget");
+		return;
+	}
+	//Forget an old failure after a long stretch within budget
+	if (++mStable >= RETRY_FRAMES && mCeiling <= MAX_SCALE){
+		mStable = 0;
+		mCeiling += STEP;
+	}
+	//Vsync hides how much time is left, the time before presenting still shows it
+	if (mBusyTime < mBudget * 0.75 && mScale < MAX_SCALE && mScale + STEP < mCeiling)
+		change(mScale + STEP, "headroom");
+}
+
+void ResolutionScaler::change(int scale, const char* reason)
+{
+	if (scale < MIN_SCALE)
+		scale = MIN_SCALE;
+	if (scale > MAX_SCALE)
+		scale = MAX_SCALE;
+	printf("Render scale %d%% -> %d%% (%s, frame %.2f ms, busy %.2f ms, budget %.2f ms)\n", mScale, scale, reason, mFrameTime * 1000, mBusyTime * 1000, mBudget * 1000);
+	mScale = scale;
+	mWidth = (SCREEN_WIDTH * scale + 50) / 100;
+	mHeight = (SCREEN_HEIGHT * scale + 50) / 100;
+	mSettle = SETTLE_FRAMES;
+}
+
+int ResolutionScaler::getScale() const
+{
+	return mScale;
+}
+
+//Keeps a loop from running faster than a frame rate by sleeping
+class FrameLimiter{
+public:
+	//Initializes variables
+	FrameLimiter();
+
+	//Frames per second, 0 for no limit
+	void setRate(int fps);
+	int getRate() const;
+
+	//Sleeps until the next frame is due
+	void wait();
+private:
+	int mRate;
+	//Performance counter ticks per frame and when the next frame is due
+	Uint64 mInterval;
+	Uint64 mNext;
+};
+
+FrameLimiter::FrameLimiter()
+{
+	mRate = 0;
+	mInterval = 0;
+	mNext = 0;
+}
+
+void FrameLimiter::setRate(int fps)
+{
+	mRate = fps > 0 ? fps : 0;
+	mInterval = mRate > 0 ? SDL_GetPerformanceFrequency() / mRate : 0;
+	mNext = 0;
+}
+
+int FrameLimiter::getRate() const
+{
+	return mRate;
+}
+
+void FrameLimiter::wait()
+{
+	if (mInterval == 0)
+		return;
+	Uint64 now = SDL_GetPerformanceCounter();
+	//Running late, start a new schedule instead of rushing to catch up
+	if (mNext <= now){
+		mNext = now + mInterval;
+		return;
+	}
+	//Sleeping past the due time is absorbed by the schedule
+	Uint32 ms = (Uint32)((mNext - now) * 1000 / SDL_GetPerformanceFrequency());
+	if (ms > 0)
+		SDL_Delay(ms);
+	mNext += mInterval;
+}
+
+//Largest packet a UdpLink carries
+const int MAX_PACKET = 256;
+
+//UDP socket to one peer. Outgoing packets can be dropped and held back on purpose,
+//so the netcode can be tried out over localhost.
+class UdpLink{
+public:
+	//Initializes variables
+	UdpLink();
+
+	//Closes the socket
+	~UdpLink();
+
+	//Binds the local port and aims at the remote one
+	bool open(int localPort, const char* host, int remotePort);
+
+	void close();
+
+	//Percent of packets lost and their delay in milliseconds, plus up to jitter more
+	void setConditions(int loss, int latency, int jitter);
+
+	//Sends a packet once its simulated delay is over
+	void send(const void* data, int size);
+
+	//Sends the held back packets that are due
+	void flush();
+
+	//Copies the next packet from the peer, returns its size or 0 when there is none
+	int receive(void* data, int size);
+
+	Uint32 getSent() const;
+	Uint32 getDropped() const;
+	Uint32 getReceived() const;
+private:
+	struct Delayed{
+		Uint32 due;
+		int size;
+		Uint8 data[MAX_PACKET];
+	};
+
+#ifdef _WIN32
+	SOCKET mSocket;
+#else
+	int mSocket;
+#endif
+	sockaddr_in mRemote;
+	std::vector<Delayed> mDelayed;
+	int mLoss;
+	int mLatency;
+	int mJitter;
+	Uint32 mNoise;
+	Uint32 mSent;
+	Uint32 mDropped;
+	Uint32 mReceived;
+};
+
+UdpLink::UdpLink()
+{
+#ifdef _WIN32
+	mSocket = INVALID_SOCKET;
+#else
+	mSocket = -1;
+#endif
+	memset(&mRemote, 0, sizeof(mRemote));
+	mLoss = 0;
+	mLatency = 0;
+	mJitter = 0;
+	mNoise = 1;
+	mSent = 0;
+	mDropped = 0;
+	mReceived = 0;
+}
+
+UdpLink::~UdpLink()
+{
+	close();
+}
+
+bool UdpLink::open(int localPort, const char* host, int remotePort)
+{
+	close();
+#ifdef _WIN32
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+	{
+		printf("Unable to start Winsock!\n");
+		return false;
+	}
+	mSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (mSocket == INVALID_SOCKET)
+	{
+		printf("Unable to create UDP socket!\n");
+		WSACleanup();
+		return false;
+	}
+	//Never wait for a packet, the game polls once a frame
+	u_long nonblocking = 1;
+	ioctlsocket(mSocket, FIONBIO, &nonblocking);
+#else
+	mSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (mSocket < 0)
+	{
+		printf("Unable to create UDP socket!\n");
+		return false;
+	}
+	//Never wait for a packet, the game polls once a frame
+	fcntl(mSocket, F_SETFL, fcntl(mSocket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+	sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_port = htons((unsigned short)localPort);
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(mSocket, (sockaddr*)&local, sizeof(local)) != 0)
+	{
+		printf("Unable to bind UDP port %d!\n", localPort);
+		close();
+		return false;
+	}
+	mRemote.sin_family = AF_INET;
+	mRemote.sin_port = htons((unsigned short)remotePort);
+	if (inet_pton(AF_INET, host, &mRemote.sin_addr) != 1)
+	{
+		printf("Unknown peer address %s!\n", host);
+		close();
+		return false;
+	}
+	mDelayed.clear();
+	mSent = 0;
+	mDropped = 0;
+	mReceived = 0;
+	return true;
+}
+
+void UdpLink::close()
+{
+#ifdef _WIN32
+	if (mSocket != INVALID_SOCKET)
+	{
+		closesocket(mSocket);
+		mSocket = INVALID_SOCKET;
+		WSACleanup();
+	}
+#else
+	if (mSocket >= 0)
+	{
+		::close(mSocket);
+		mSocket = -1;
+	}
+#endif
+}
+
+void UdpLink::setConditions(int loss, int latency, int jitter)
+{
+	mLoss = loss > 0 ? loss : 0;
+	mLatency = latency > 0 ? latency : 0;
+	mJitter = jitter > 0 ? jitter : 0;
+}
+
+void UdpLink::send(const void* data, int size)
+{
+	if (size > MAX_PACKET)
+		return;
+	mSent++;
+	mNoise = mNoise * 1664525 + 1013904223;
+	if ((int)(mNoise >> 16) % 100 < mLoss)
+	{
+		mDropped++;
+		return;
+	}
+	Delayed packet;
+	packet.due = SDL_GetTicks() + mLatency + (mJitter > 0 ? (int)(mNoise >> 8) % (mJitter + 1) : 0);
+	packet.size = size;
+	memcpy(packet.data, data, size);
+	mDelayed.push_back(packet);
+	flush();
+}
+
+void UdpLink::flush()
+{
+	//Jitter can let a later packet overtake an earlier one, like a real network
+	Uint32 now = SDL_GetTicks();
+	for (size_t i = 0; i < mDelayed.size();){
+		if ((Sint32)(mDelayed[i].due - now) > 0)
+		{
+			i++;
+			continue;
+		}
+		sendto(mSocket, (const char*)mDelayed[i].data, mDelayed[i].size, 0, (const sockaddr*)&mRemote, sizeof(mRemote));
+		mDelayed[i] = mDelayed.back();
+		mDelayed.pop_back();
+	}
+}
+
+int UdpLink::receive(void* data, int size)
+{
+	for (;;){
+		sockaddr_in from;
+		socklen_t length = sizeof(from);
+		int received = (int)recvfrom(mSocket, (char*)data, size, 0, (sockaddr*)&from, &length);
+		if (received <= 0)
+			return 0;
+		//Anyone else sending to the port is ignored
+		if (from.sin_port != mRemote.sin_port || from.sin_addr.s_addr != mRemote.sin_addr.s_addr)
+			continue;
+		mReceived++;
+		return received;
+	}
+}
+
+Uint32 UdpLink::getSent() const
+{
+	return mSent;
+}
+
+Uint32 UdpLink::getDropped() const
+{
+	return mDropped;
+}
+
+Uint32 UdpLink::getReceived() const
+{
+	return mReceived;
+}
+
+//Frames the game may run ahead of the newest input from the remote player
+const int ROLLBACK_FRAMES = 8;
+
+//Peer to peer rollback for two players. The local input is used right away and the
+//remote player is predicted to keep pressing what it pressed last. When its real input
+//turns out different, the game is loaded from the snapshot of that frame and run again
+//up to the present within the same frame.
+class RollbackSession{
+public:
+	//Game callbacks. The state must be the same bytes on both machines after the same inputs.
+	typedef void (*SaveState)(void* data, std::vector<Uint8>& state);
+	typedef void (*LoadState)(void* data, const std::vector<Uint8>& state);
+	//Runs a frame with the input of each player, live is false when it is run again
+	typedef void (*StepFrame)(void* data, const Uint8* inputs, bool live);
+
+	//Initializes variables
+	RollbackSession();
+
+	void setGame(void* game, SaveState save, LoadState load, StepFrame step);
+
+	//Starts talking to the peer, player is 0 or 1 and must differ between the two
+	bool start(int player, int localPort, const char* host, int remotePort);
+
+	void stop();
+
+	//Network conditions are simulated on the link
+	UdpLink& getLink();
+
+	//Runs the next frame with the local input, after rolling back any frames the remote
+	//input proved wrong. Returns false when the frame has to wait for the remote player.
+	bool advance(Uint8 input);
+
+	bool isConnected() const;
+	//True once the peer quit and all its inputs were run, or it went silent
+	bool hasPeerLeft() const;
+	int getPlayer() const;
+	//Next frame to run
+	int getFrame() const;
+	//Newest frame whose state both peers have for certain, -1 before the first
+	int getSettledFrame() const;
+	//State at the start of a settled frame, NULL when it was already reused
+	const std::vector<Uint8>* getSettledState(int frame) const;
+
+	void print_stats();
+private:
+	//Frames of inputs and snapshots kept, more than the two players can be apart
+	static const int RING = 32;
+	//Milliseconds without a packet before the peer counts as gone
+	static const Uint32 TIMEOUT = 5000;
+
+	//Sent every frame, little endian so the peers may differ in byte order
+	struct Packet{
+		char magic[4];
+		//Frame of the newest input in the packet, -1 before the first
+		Sint32 frame;
+		//Newest frame of the receiver's input the sender has
+		Sint32 ack;
+		//Checksum of the state at a frame whose inputs the sender all has, -1 for none
+		Sint32 checkFrame;
+		Uint32 checksum;
+		//How far the sender runs ahead of the inputs it has
+		Sint8 advantage;
+		Uint8 count;
+		//Set when the sender has left the game
+		Uint8 quit;
+		//Inputs of the frames ending at frame, oldest first
+		Uint8 inputs[ROLLBACK_FRAMES * 2];
+	};
+
+	void receive();
+	void send();
+	//Loads the first mispredicted frame and runs again up to the present
+	void resimulate();
+	//Compares the checksums from the peer against frames that can't change any more
+	void check();
+	//Newest frame whose state both peers have for certain
+	int final_frame() const;
+	Uint8 predict() const;
+
+	UdpLink mLink;
+	void* mGame;
+	SaveState mSave;
+	LoadState mLoad;
+	StepFrame mStep;
+	int mPlayer;
+	bool mConnected;
+	//Set in the packets sent while stopping
+	bool mQuitting;
+	bool mPeerQuit;
+	bool mPeerLeft;
+	//Ticks of the last packet from the peer
+	Uint32 mLastPacket;
+	int mFrame;
+	//Newest remote input, every frame up to it is known
+	int mRemoteFrame;
+	//Newest local input the peer has
+	int mRemoteAck;
+	int mRemoteAdvantage;
+	//First frame run with a wrong prediction, -1 for none
+	int mRollbackFrom;
+	//Frame of the last wait to let the peer catch up
+	int mSyncFrame;
+	Uint8 mInputs[2][RING];
+	//State at the start of each frame and its checksum
+	std::vector<Uint8> mStates[RING];
+	Uint32 mChecksums[RING];
+	//Checksums from the peer waiting to be compared, by frame
+	Sint32 mPeerFrames[RING];
+	Uint32 mPeerChecksums[RING];
+
+	Uint32 mFrames;
+	Uint32 mStalls;
+	Uint32 mSyncWaits;
+	Uint32 mRollbacks;
+	Uint32 mResimulated;
+	int mDeepest;
+	Uint64 mResimTime;
+	Uint64 mWorstResim;
+	Uint32 mChecks;
+	Uint32 mDesyncs;
+	int mFirstDesync;
+};
+
+RollbackSession::RollbackSession()
+{
+	mGame = NULL;
+	mSave = NULL;
+	mLoad = NULL;
+	mStep = NULL;
+	mPlayer = 0;
+	mConnected = false;
+	mQuitting = false;
+	mPeerQuit = false;
+	mPeerLeft = false;
+	mFrame = 0;
+	mFrames = 0;
+}
+
+void RollbackSession::setGame(void* game, SaveState save, LoadState load, StepFrame step)
+{
+	mGame = game;
+	mSave = save;
+	mLoad = load;
+	mStep = step;
+}
+
+bool RollbackSession::start(int player, int localPort, const char* host, int remotePort)
+{
+	if (!mLink.open(localPort, host, remotePort))
+		return false;
+	mPlayer = player;
+	mConnected = false;
+	mQuitting = false;
+	mPeerQuit = false;
+	mPeerLeft = false;
+	mLastPacket = SDL_GetTicks();
+	mFrame = 0;
+	mRemoteFrame = -1;
+	mRemoteAck = -1;
+	mRemoteAdvantage = 0;
+	mRollbackFrom = -1;
+	mSyncFrame = 0;
+	memset(mInputs, 0, sizeof(mInputs));
+	memset(mChecksums, 0, sizeof(mChecksums));
+	for (int i = 0; i < RING; i++)
+		mPeerFrames[i] = -1;
+	mFrames = 0;
+	mStalls = 0;
+	mSyncWaits = 0;
+	mRollbacks = 0;
+	mResimulated = 0;
+	mDeepest = 0;
+	mResimTime = 0;
+	mWorstResim = 0;
+	mChecks = 0;
+	mDesyncs = 0;
+	mFirstDesync = -1;
+	return true;
+}
+
+void RollbackSession::stop()
+{
+	//The peer may still need the last inputs to finish its frames
+	mQuitting = true;
+	Uint32 until = SDL_GetTicks() + 1000;
+	while (mConnected && mRemoteAck < mFrame - 1 && (Sint32)(until - SDL_GetTicks()) > 0){
+		receive();
+		send();
+		SDL_Delay(15);
+	}
+	//A few more in case the packets saying so get lost, the timeout covers the rest
+	for (int i = 0; mConnected && i < 3; i++)
+		send();
+	mLink.close();
+	mConnected = false;
+}
+
+UdpLink& RollbackSession::getLink()
+{
+	return mLink;
+}
+
+bool RollbackSession::advance(Uint8 input)
+{
+	mLink.flush();
+	if (mPeerLeft)
+		return false;
+	receive();
+	if (!mConnected)
+	{
+		//Keep knocking until the peer answers
+		send();
+		return false;
+	}
+	//Frames past the last input of a peer that quit would only be predictions
+	if ((mPeerQuit && mFrame > mRemoteFrame + 1) || SDL_GetTicks() - mLastPacket > TIMEOUT)
+	{
+		mConnected = false;
+		mPeerLeft = true;
+		return false;
+	}
+	if (mRollbackFrom >= 0)
+		resimulate();
+	check();
+	//Predicting further would make rollbacks too long to run in one frame
+	if (mFrame - mRemoteFrame > ROLLBACK_FRAMES)
+	{
+		mStalls++;
+		send();
+		return false;
+	}
+	//Running ahead of the peer, give it a frame to catch up now and then
+	int advantage = mFrame - mRemoteFrame;
+	if (advantage - mRemoteAdvantage >= 2 && mFrame - mSyncFrame >= 10)
+	{
+		mSyncFrame = mFrame;
+		mSyncWaits++;
+		send();
+		return false;
+	}
+	int slot = mFrame & (RING - 1);
+	mInputs[mPlayer][slot] = input;
+	if (mFrame > mRemoteFrame)
+		mInputs[1 - mPlayer][slot] = predict();
+	mSave(mGame, mStates[slot]);
+	mChecksums[slot] = fnv1a(mStates[slot].empty() ? NULL : &mStates[slot][0], mStates[slot].size());
+	Uint8 inputs[2] = { mInputs[0][slot], mInputs[1][slot] };
+	mStep(mGame, inputs, true);
+	mFrame++;
+	mFrames++;
+	send();
+	return true;
+}
+
+bool RollbackSession::isConnected() const
+{
+	return mConnected;
+}
+
+bool RollbackSession::hasPeerLeft() const
+{
+	return mPeerLeft;
+}
+
+int RollbackSession::getPlayer() const
+{
+	return mPlayer;
+}
+
+int RollbackSession::getFrame() const
+{
+	return mFrame;
+}
+
+int RollbackSession::getSettledFrame() const
+{
+	return final_frame();
+}
+
+const std::vector<Uint8>* RollbackSession::getSettledState(int frame) const
+{
+	if (frame < 0 || frame > final_frame() || frame <= mFrame - RING)
+		return NULL;
+	return &mStates[frame & (RING - 1)];
+}
+
+void RollbackSession::receive()
+{
+	Packet packet;
+	while (mLink.receive(&packet, sizeof(packet)) == (int)sizeof(packet)){
+		if (memcmp(packet.magic, "SRNP", 4) != 0 || packet.count > ROLLBACK_FRAMES * 2)
+			continue;
+		packet.frame = SDL_SwapLE32(packet.frame);
+		packet.ack = SDL_SwapLE32(packet.ack);
+		packet.checkFrame = SDL_SwapLE32(packet.checkFrame);
+		packet.checksum = SDL_SwapLE32(packet.checksum);
+		mConnected = true;
+		mLastPacket = SDL_GetTicks();
+		if (packet.ack > mRemoteAck)
+			mRemoteAck = packet.ack;
+		mRemoteAdvantage = packet.advantage;
+		//Packets resend everything not acknowledged, so only a reordered one can leave a gap
+		int first = packet.frame - packet.count + 1;
+		if (packet.frame > mRemoteFrame && first <= mRemoteFrame + 1)
+		{
+			int remote = 1 - mPlayer;
+			for (int frame = mRemoteFrame + 1; frame <= packet.frame; frame++){
+				Uint8 input = packet.inputs[frame - first];
+				int slot = frame & (RING - 1);
+				//Frames already run used a prediction
+				if (frame < mFrame && mInputs[remote][slot] != input && (mRollbackFrom < 0 || frame < mRollbackFrom))
+					mRollbackFrom = frame;
+				mInputs[remote][slot] = input;
+			}
+			mRemoteFrame = packet.frame;
+		}
+		if (packet.checkFrame >= 0)
+		{
+			mPeerFrames[packet.checkFrame & (RING - 1)] = packet.checkFrame;
+			mPeerChecksums[packet.checkFrame & (RING - 1)] = packet.checksum;
+		}
+		//Its inputs came in with the same packet
+		if (packet.quit)
+			mPeerQuit = true;
+	}
+}
+
+void RollbackSession::send()
+{
+	Packet packet;
+	memset(&packet, 0, sizeof(packet));
+	memcpy(packet.magic, "SRNP", 4);
+	packet.frame = mFrame - 1;
+	packet.ack = mRemoteFrame;
+	//Everything the peer has not acknowledged, losing packets costs nothing but bandwidth
+	int first = std::max(mRemoteAck + 1, mFrame - ROLLBACK_FRAMES * 2);
+	packet.count = (Uint8)(mFrame - first);
+	for (int i = 0; i < packet.count; i++)
+		packet.inputs[i] = mInputs[mPlayer][(first + i) & (RING - 1)];
+	int advantage = mConnected ? mFrame - mRemoteFrame : 0;
+	packet.advantage = (Sint8)std::max(-100, std::min(100, advantage));
+	packet.quit = mQuitting;
+	packet.checkFrame = final_frame();
+	if (packet.checkFrame >= 0)
+		packet.checksum = SDL_SwapLE32(mChecksums[packet.checkFrame & (RING - 1)]);
+	packet.frame = SDL_SwapLE32(packet.frame);
+	packet.ack = SDL_SwapLE32(packet.ack);
+	packet.checkFrame = SDL_SwapLE32(packet.checkFrame);
+	mLink.send(&packet, sizeof(packet));
+}
+
+void RollbackSession::resimulate()
+{
+	Uint64 start = SDL_GetPerformanceCounter();
+	int from = mRollbackFrom;
+	int remote = 1 - mPlayer;
+	Uint8 predicted = predict();
+	mLoad(mGame, mStates[from & (RING - 1)]);
+	for (int frame = from; frame < mFrame; frame++){
+		int slot = frame & (RING - 1);
+		//Frames past the newest remote input are predicted again from it
+		if (frame > mRemoteFrame)
+			mInputs[remote][slot] = predicted;
+		if (frame > from)
+		{
+			mSave(mGame, mStates[slot]);
+			mChecksums[slot] = fnv1a(mStates[slot].empty() ? NULL : &mStates[slot][0], mStates[slot].size());
+		}
+		Uint8 inputs[2] = { mInputs[0][slot], mInputs[1][slot] };
+		mStep(mGame, inputs, false);
+	}
+	Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+	mRollbacks++;
+	mResimulated += mFrame - from;
+	mDeepest = std::max(mDeepest, mFrame - from);
+	mResimTime += elapsed;
+	mWorstResim = std::max(mWorstResim, elapsed);
+	mRollbackFrom = -1;
+}
+
+void RollbackSession::check()
+{
+	int last = final_frame();
+	for (int i = 0; i < RING; i++){
+		int frame = mPeerFrames[i];
+		if (frame < 0 || frame > last)
+			continue;
+		//Too old, the snapshot was reused
+		if (frame > mFrame - RING)
+		{
+			mChecks++;
+			if (mPeerChecksums[i] != mChecksums[i])
+			{
+				if (mDesyncs == 0)
+				{
+					mFirstDesync = frame;
+					printf("Netplay desync at frame %d!\n", frame);
+				}
+				mDesyncs++;
+			}
+		}
+		mPeerFrames[i] = -1;
+	}
+}
+
+int RollbackSession::final_frame() const
+{
+	//The state at the start of a frame is settled once every input before it is known
+	return std::min(mRemoteFrame + 1, mFrame - 1);
+}
+
+Uint8 RollbackSession::predict() const
+{
+	return mRemoteFrame >= 0 ? mInputs[1 - mPlayer][mRemoteFrame & (RING - 1)] : 0;
+}
+
+void RollbackSession::print_stats()
+{
+	if (mGame == NULL || mFrames == 0)
+		return;
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	printf("Netplay: player %d, %u frames, %u waited for the peer's input, %u waited to stay in step\n", mPlayer + 1, mFrames, mStalls, mSyncWaits);
+	printf("  %u rollbacks, %u frames resimulated, deepest %d frames\n", mRollbacks, mResimulated, mDeepest);
+	if (mRollbacks > 0)
+		printf("  resimulation %.3f ms per rollback, worst %.3f ms, %.3f ms per frame played\n", mResimTime / frequency * 1000 / mRollbacks, mWorstResim / frequency * 1000, mResimTime / frequency * 1000 / mFrames);
+	printf("  %u state checks, %u desyncs", mChecks, mDesyncs);
+	if (mDesyncs > 0)
+		printf(", first at frame %d", mFirstDesync);
+	printf("\n");
+	printf("  %u packets sent, %u dropped on purpose, %u received\n", mLink.getSent(), mLink.getDropped(), mLink.getReceived());
+	if (mPeerLeft)
+		printf("  the peer %s at frame %d\n", mPeerQuit ? "quit" : "timed out", mRemoteFrame);
+}
+
+//Sides of a moving box that ran into solid tiles
+enum TileHit { HIT_NONE = 0, HIT_LEFT = 1, HIT_RIGHT = 2, HIT_TOP = 4, HIT_BOTTOM = 8 };
+
+//Level terrain, one solid bit per tile
+class TileMap{
+public:
+	//Initializes variables
+	TileMap();
+
+	//Loads a level from text, one character per tile: '#' is a solid tile,
+	//'=' is a solid tile already painted in the background, '-' is a platform
+	//that is only solid from above, anything else is empty
+	bool load(std::string path);
+
+	//Draws the solid tiles that are not part of the background
+	void render(SDL_Rect& camera) const;
+
+	//Checks a tile, the sides of the level are walls and the bottom is open
+	bool solid(int column, int row) const;
+
+	//Checks the tile under a world position
+	bool solid_at(int x, int y) const;
+
+	//Checks whether something can stand on the tile under a world position
+	bool floor_at(int x, int y) const;
+
+	//Checks whether a box at (x, y) overlaps any solid tile, body is relative to (x, y)
+	bool overlaps(int x, int y, const SDL_Rect& body) const;
+
+	//Moves a box at (x, y) by (dx, dy), stopping it against solid tiles.
+	//body is the box relative to (x, y). Returns the TileHit sides that touched.
+	int move(int& x, int& y, const SDL_Rect& body, int dx, int dy) const;
+
+	//Tile holding a world coordinate, rounding towards negative infinity
+	static int to_tile(int pixel);
+
+	//Level size in tiles
+	int getColumns() const;
+	int getRows() const;
+private:
+
+	//Sweeps one axis at most a tile at a time
+	int sweep_x(int& x, int y, const SDL_Rect& body, int dx) const;
+	int sweep_y(int x, int& y, const SDL_Rect& body, int dy) const;
+
+	//Level size in tiles
+	int mColumns;
+	int mRows;
+	//Words per row
+	int mStride;
+	//Row major bits, column c of a row is bit c%64 of word c/64
+	std::vector<Uint64> mBits;
+	//Same layout, set for the tiles that have to be drawn
+	std::vector<Uint64> mDrawn;
+	//Same layout, set for the platforms that are only solid from above
+	std::vector<Uint64> mOneWay;
+};
+
+TileMap::TileMap()
+{
+	mColumns = 0;
+	mRows = 0;
+	mStride = 0;
+}
+
+bool TileMap::load(std::string path)
+{
+	SDL_RWops* file = gAssets.open_asset(path);
+	if (file == NULL)
+	{
+		printf("Unable to load level %s! SDL Error: %s\n", path.c_str(), SDL_GetError());
+		return false;
+	}
+	Uint64 decodeStart = SDL_GetPerformanceCounter();
+	std::string text((size_t)SDL_RWsize(file), '\0');
+	size_t read = text.empty() ? 0 : SDL_RWread(file, &text[0], 1, text.size());
+	SDL_RWclose(file);
+	text.resize(read);
+
+	//The level always covers LEVEL_WIDTH x LEVEL_HEIGHT, missing tiles are empty
+	mColumns = (LEVEL_WIDTH + TILE_SIZE - 1) / TILE_SIZE;
+	mRows = (LEVEL_HEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+	mStride = (mColumns + 63) / 64;
+	mBits.assign(mStride * mRows, 0);
+	mDrawn.assign(mStride * mRows, 0);
+	mOneWay.assign(mStride * mRows, 0);
+	int row = 0, column = 0;
+	for (size_t i = 0; i < text.size() && row < mRows; i++){
+		if (text[i] == '\n'){
+			row++;
+			column = 0;
+			continue;
+		}
+		if ((text[i] == '#' || text[i] == '=') && column < mColumns)
+			mBits[row * mStride + (column >> 6)] |= (Uint64)1 << (column & 63);
+		if ((text[i] == '#' || text[i] == '-') && column < mColumns)
+			mDrawn[row * mStride + (column >> 6)] |= (Uint64)1 << (column & 63);
+		if (text[i] == '-' && column < mColumns)
+			mOneWay[row * mStride + (column >> 6)] |= (Uint64)1 << (column & 63);
+		if (text[i] != '\r')
+			column++;
+	}
+	gStartup.asset(path, (Sint64)text.size(), SDL_GetPerformanceCounter() - decodeStart, 0);
+	return true;
+}
+
+void TileMap::render(SDL_Rect& camera) const
+{
+	int firstColumn = to_tile(camera.x) > 0 ? to_tile(camera.x) : 0;
+	int lastColumn = to_tile(camera.x + camera.w - 1) < mColumns - 1 ? to_tile(camera.x + camera.w - 1) : mColumns - 1;
+	int firstRow = to_tile(camera.y) > 0 ? to_tile(camera.y) : 0;
+	int lastRow = to_tile(camera.y + camera.h - 1) < mRows - 1 ? to_tile(camera.y + camera.h - 1) : mRows - 1;
+	for (int row = firstRow; row <= lastRow; row++){
+		const Uint64* drawn = &mDrawn[row * mStride];
+		for (int column = firstColumn; column <= lastColumn; column++){
+			if (((drawn[column >> 6] >> (column & 63)) & 1) == 0)
+				continue;
+			//One rectangle per run of tiles
+			int end = column;
+			while (end + 1 <= lastColumn && ((drawn[(end + 1) >> 6] >> ((end + 1) & 63)) & 1))
+				end++;
+			SDL_Rect tile = { column * TILE_SIZE - camera.x, row * TILE_SIZE - camera.y, (end - column + 1) * TILE_SIZE, TILE_SIZE };
+			SDL_SetRenderDrawColor(gRenderer, 0x6B, 0x4A, 0x2B, 0xFF);
+			SDL_RenderFillRect(gRenderer, &tile);
+			//Grass on top of surfaces
+			if (!floor_at(column * TILE_SIZE, (row - 1) * TILE_SIZE)){
+				tile.h = 4;
+				SDL_SetRenderDrawColor(gRenderer, 0x4C, 0x9A, 0x2A, 0xFF);
+				SDL_RenderFillRect(gRenderer, &tile);
+			}
+			column = end;
+		}
+	}
+}
+
+bool TileMap::solid(int column, int row) const
+{
+	if (column < 0 || column >= mColumns)
+		return true;
+	if (row < 0 || row >= mRows)
+		return false;
+	return (mBits[row * mStride + (column >> 6)] >> (column & 63)) & 1;
+}
+
+bool TileMap::solid_at(int x, int y) const
+{
+	return solid(to_tile(x), to_tile(y));
+}
+
+bool TileMap::floor_at(int x, int y) const
+{
+	int column = to_tile(x), row = to_tile(y);
+	if (solid(column, row))
+		return true;
+	if (column < 0 || column >= mColumns || row < 0 || row >= mRows)
+		return false;
+	return (mOneWay[row * mStride + (column >> 6)] >> (column & 63)) & 1;
+}
+
+bool TileMap::overlaps(int x, int y, const SDL_Rect& body) const
+{
+	int left = to_tile(x + body.x), right = to_tile(x + body.x + body.w - 1);
+	int top = to_tile(y + body.y), bottom = to_tile(y + body.y + body.h - 1);
+	for (int row = top; row <= bottom; row++){
+		for (int column = left; column <= right; column++){
+			if (solid(column, row))
+				return true;
+		}
+	}
+	return false;
+}
+
+int TileMap::to_tile(int pixel)
+{
+	return pixel >= 0 ? pixel / TILE_SIZE : (pixel - TILE_SIZE + 1) / TILE_SIZE;
+}
+
+int TileMap::getColumns() const
+{
+	return mColumns;
+}
+
+int TileMap::getRows() const
+{
+	return mRows;
+}
+
+int TileMap::move(int& x, int& y, const SDL_Rect& body, int dx, int dy) const
+{
+	int hits = HIT_NONE;
+	//Steps of at most one tile cannot tunnel through a wall
+	while (dx != 0){
+		int step = dx > TILE_SIZE ? TILE_SIZE : dx < -TILE_SIZE ? -TILE_SIZE : dx;
+		int hit = sweep_x(x, y, body, step);
+		hits |= hit;
+		dx = hit != HIT_NONE ? 0 : dx - step;
+	}
+	while (dy != 0){
+		int step = dy > TILE_SIZE ? TILE_SIZE : dy < -TILE_SIZE ? -TILE_SIZE : dy;
+		int hit = sweep_y(x, y, body, step);
+		hits |= hit;
+		dy = hit != HIT_NONE ? 0 : dy - step;
+	}
+	return hits;
+}
+
+int TileMap::sweep_x(int& x, int y, const SDL_Rect& body, int dx) const
+{
+	if (mRows == 0){
+		x += dx;
+		return HIT_NONE;
+	}
+	int top = y + body.y;
+	int bottom = y + body.y + body.h - 1;
+	//Leading edge before and after the step
+	int edge = dx > 0 ? x + body.x + body.w - 1 : x + body.x;
+	int target = edge + dx;
+	int first = (dx > 0 ? edge + 1 : edge - 1);
+	int step = dx > 0 ? 1 : -1;
+	//Only the tile columns the edge enters are checked, at most two
+	int fromColumn = to_tile(first);
+	int toColumn = to_tile(target);
+	int topRow = to_tile(top);
+	int bottomRow = to_tile(bottom);
+	for (int column = fromColumn; column != toColumn + step; column += step){
+		for (int row = topRow; row <= bottomRow; row++){
+			if (solid(column, row)){
+				//Stop flush against the tile
+				if (dx > 0)
+					x += column * TILE_SIZE - 1 - edge;
+				else
+					x += (column + 1) * TILE_SIZE - edge;
+				return dx > 0 ? HIT_RIGHT : HIT_LEFT;
+			}
+		}
+	}
+	x += dx;
+	return HIT_NONE;
+}
+
+int TileMap::sweep_y(int x, int& y, const SDL_Rect& body, int dy) const
+{
+	if (mRows == 0){
+		y += dy;
+		return HIT_NONE;
+	}
+	int left = x + body.x;
+	int right = x + body.x + body.w - 1;
+	int edge = dy > 0 ? y + body.y + body.h - 1 : y + body.y;
+	int target = edge + dy;
+	int first = (dy > 0 ? edge + 1 : edge - 1);
+	int step = dy > 0 ? 1 : -1;
+	int fromRow = to_tile(first);
+	int toRow = to_tile(target);
+	int leftColumn = to_tile(left);
+	int rightColumn = to_tile(right);
+	for (int row = fromRow; row != toRow + step; row += step){
+		//Platforms only stop a fall that started above them
+		bool landing = dy > 0 && row * TILE_SIZE > edge;
+		for (int column = leftColumn; column <= rightColumn; column++){
+			if (solid(column, row) || (landing && floor_at(column * TILE_SIZE, row * TILE_SIZE))){
+				if (dy > 0)
+					y += row * TILE_SIZE - 1 - edge;
+				else
+					y += (row + 1) * TILE_SIZE - edge;
+				return dy > 0 ? HIT_BOTTOM : HIT_TOP;
+			}
+		}
+	}
+	y += dy;
+	return HIT_NONE;
+}
+
+//Terrain of the current level
+TileMap gLevel;
+
+//Way a flow field tile points
+enum FlowDirection { FLOW_NONE, FLOW_LEFT, FLOW_RIGHT, FLOW_UP, FLOW_DOWN };
+
+//Shortest way to a goal from every open tile of the level, shared by any number of enemies
+class FlowField{
+public:
+	//Initializes variables
+	FlowField();
+
+	//Sizes the field to a level, every tile points nowhere until the first search
+	void init(const TileMap& level);
+
+	//Leads the field to a world position. Searches for a new goal tile run on a worker
+	//while the old field stays in use and are swapped in by a later call, so only the
+	//game thread may call this, once per frame.
+	void update(int x, int y, WorkerPool& workers);
+
+	//Searches for a world position on the calling thread and uses the result right away
+	void build(int x, int y);
+
+	//Like update, but searches on the calling thread, so the field never lags behind
+	//the goal and two machines running the same frames sample the same field
+	void update_now(int x, int y);
+
+	//Step towards the goal from a world position, -1, 0 or 1 on each axis
+	void sample(int x, int y, int& dx, int& dy) const;
+
+	//Tiles to the goal from a world position, -1 if it can't be reached
+	int distance(int x, int y) const;
+
+	//Level the field was made for, only after init
+	const TileMap& getLevel() const;
+private:
+	static void search_job(void* data, int begin, int end);
+
+	//Breadth first search from the goal tile into the back buffers
+	void search();
+
+	//Checks a goal tile before searching for it
+	bool open(int column, int row) const;
+
+	const TileMap* mLevel;
+	int mColumns;
+	int mRows;
+	//One byte per tile, set where the level is not solid
+	std::vector<Uint8> mOpen;
+	//Front buffers are sampled, back buffers belong to the search
+	std::vector<Uint8> mDirections[2];
+	std::vector<Uint16> mDistances[2];
+	int mFront;
+	std::vector<int> mQueue;
+	//Goal tile of the newest search
+	int mGoalColumn;
+	int mGoalRow;
+	//A search was handed to the workers and is not swapped in yet
+	bool mSearching;
+	std::atomic<int> mPending;
+};
+
+//Distance of the tiles the search never reached
+const Uint16 FLOW_UNREACHED = 0xFFFF;
+
+FlowField::FlowField()
+{
+	mLevel = NULL;
+	mColumns = 0;
+	mRows = 0;
+	mFront = 0;
+	mGoalColumn = -1;
+	mGoalRow = -1;
+	mSearching = false;
+	mPending.store(0);
+}
+
+void FlowField::init(const TileMap& level)
+{
+	mLevel = &level;
+	mColumns = level.getColumns();
+	mRows = level.getRows();
+	for (int i = 0; i < 2; i++){
+		mDirections[i].assign(mColumns * mRows, FLOW_NONE);
+		mDistances[i].assign(mColumns * mRows, FLOW_UNREACHED);
+	}
+	mQueue.resize(mColumns * mRows);
+	//The search reads a byte per tile instead of testing bits
+	mOpen.resize(mColumns * mRows);
+	for (int row = 0; row < mRows; row++){
+		for (int column = 0; column < mColumns; column++)
+			mOpen[row * mColumns + column] = !level.solid(column, row);
+	}
+	mGoalColumn = -1;
+	mGoalRow = -1;
+}
+
+bool FlowField::open(int column, int row) const
+{
+	return column >= 0 && column < mColumns && row >= 0 && row < mRows && mOpen[row * mColumns + column];
+}
+
+void FlowField::update(int x, int y, WorkerPool& workers)
+{
+	//Swap in a finished search, the back buffers are free again afterwards
+	if (mSearching){
+		if (mPending.load(std::memory_order_acquire) != 0)
+			return;
+		mFront ^= 1;
+		mSearching = false;
+	}
+	//Nothing to do until the goal moves to another tile
+	int column = TileMap::to_tile(x), row = TileMap::to_tile(y);
+	if ((column == mGoalColumn && row == mGoalRow) || !open(column, row))
+		return;
+	mGoalColumn = column;
+	mGoalRow = row;
+	mSearching = true;
+	workers.submit(search_job, this, 0, 1, mPending);
+}
+
+void FlowField::build(int x, int y)
+{
+	int column = TileMap::to_tile(x), row = TileMap::to_tile(y);
+	if (mSearching || !open(column, row))
+		return;
+	mGoalColumn = column;
+	mGoalRow = row;
+	search();
+	mFront ^= 1;
+}
+
+void FlowField::update_now(int x, int y)
+{
+	if (TileMap::to_tile(x) == mGoalColumn && TileMap::to_tile(y) == mGoalRow)
+		return;
+	build(x, y);
+}
+
+const TileMap& FlowField::getLevel() const
+{
+	return *mLevel;
+}
+
+void FlowField::search_job(void* data, int, int)
+{
+	((FlowField*)data)->search();
+}
+
+void FlowField::search()
+{
+	int back = mFront ^ 1;
+	Uint16* distances = &mDistances[back][0];
+	Uint8* directions = &mDirections[back][0];
+	const Uint8* open = &mOpen[0];
+	int* queue = &mQueue[0];
+	int cells = mColumns * mRows;
+	for (int i = 0; i < cells; i++)
+		distances[i] = FLOW_UNREACHED;
+	int head = 0, tail = 0;
+	distances[mGoalRow * mColumns + mGoalColumn] = 0;
+	queue[tail++] = mGoalRow * mColumns + mGoalColumn;
+	while (head < tail){
+		int cell = queue[head++];
+		int column = cell % mColumns;
+		Uint16 next = distances[cell] + 1;
+		int neighbours[4] = { column > 0 ? cell - 1 : -1, column < mColumns - 1 ? cell + 1 : -1, cell - mColumns, cell + mColumns };
+		for (int n = 0; n < 4; n++){
+			int neighbour = neighbours[n];
+			if (neighbour < 0 || neighbour >= cells || !open[neighbour] || distances[neighbour] != FLOW_UNREACHED)
+				continue;
+			distances[neighbour] = next;
+			queue[tail++] = neighbour;
+		}
+	}
+	//Point every tile at a neighbour one step closer, sideways first so walkers
+	//keep walking until the goal is straight above or below them
+	for (int row = 0; row < mRows; row++){
+		for (int column = 0; column < mColumns; column++){
+			int cell = row * mColumns + column;
+			Uint8 direction = FLOW_NONE;
+			Uint16 distance = distances[cell];
+			if (distance != FLOW_UNREACHED && distance != 0){
+				if (column > 0 && distances[cell - 1] < distance)
+					direction = FLOW_LEFT;
+				else if (column < mColumns - 1 && distances[cell + 1] < distance)
+					direction = FLOW_RIGHT;
+				else if (row > 0 && distances[cell - mColumns] < distance)
+					direction = FLOW_UP;
+				else if (row < mRows - 1 && distances[cell + mColumns] < distance)
+					direction = FLOW_DOWN;
+			}
+			directions[cell] = direction;
+		}
+	}
+}
+
+void FlowField::sample(int x, int y, int& dx, int& dy) const
+{
+	static const int stepX[] = { 0, -1, 1, 0, 0 };
+	static const int stepY[] = { 0, 0, 0, -1, 1 };
+	int column = TileMap::to_tile(x), row = TileMap::to_tile(y);
+	if (column < 0 || column >= mColumns || row < 0 || row >= mRows){
+		dx = 0;
+		dy = 0;
+		return;
+	}
+	Uint8 direction = mDirections[mFront][row * mColumns + column];
+	dx = stepX[direction];
+	dy = stepY[direction];
+}
+
+int FlowField::distance(int x, int y) const
+{
+	int column = TileMap::to_tile(x), row = TileMap::to_tile(y);
+	if (column < 0 || column >= mColumns || row < 0 || row >= mRows)
+		return -1;
+	Uint16 distance = mDistances[mFront][row * mColumns + column];
+	return distance != FLOW_UNREACHED ? distance : -1;
+}
+
+//Crowd of simple walkers that follow one flow field, kept in arrays so thousands
+//of them can be stepped in batches on the workers
+class Swarm{
+public:
+	//Initializes variables
+	Swarm();
+
+	//Adds a walker at a world position
+	void spawn(int x, int y);
+
+	//Moves every walker one frame along the field
+	void update(const FlowField& field, WorkerPool& workers);
+
+	int getCount() const;
+	int getX(int i) const;
+	int getY(int i) const;
+
+	//Box that collides with the terrain, relative to a walker's position
+	SDL_Rect body;
+	//Walking and jumping speed in pixels per frame
+	int speed;
+	int jump;
+private:
+	static void update_job(void* data, int begin, int end);
+
+	std::vector<int> mX;
+	std::vector<int> mY;
+	std::vector<int> mFall;
+	std::vector<Uint8> mGrounded;
+	//Field of the update in progress
+	const FlowField* mField;
+};
+
+Swarm::Swarm()
+{
+	//Same size as a dog
+	body.x = 8; body.y = 2; body.w = 60; body.h = 40;
+	speed = 3;
+	jump = 10;
+	mField = NULL;
+}
+
+void Swarm::spawn(int x, int y)
+{
+	mX.push_back(x);
+	mY.push_back(y);
+	mFall.push_back(0);
+	mGrounded.push_back(0);
+}
+
+void Swarm::update(const FlowField& field, WorkerPool& workers)
+{
+	mField = &field;
+	workers.run(update_job, this, getCount());
+	mField = NULL;
+}
+
+void Swarm::update_job(void* data, int begin, int end)
+{
+	Swarm* swarm = (Swarm*)data;
+	const SDL_Rect& body = swarm->body;
+	for (int i = begin; i < end; i++){
+		int dx, dy;
+		swarm->mField->sample(swarm->mX[i] + body.x + body.w / 2, swarm->mY[i] + body.y + body.h / 2, dx, dy);
+		//The field leads upwards over walls and onto ledges, walkers get there by jumping
+		int fall = swarm->mFall[i];
+		if (dy < 0 && swarm->mGrounded[i])
+			fall = -swarm->jump;
+		else if (fall < GRAVITY)
+			fall++;
+		//The map the field was searched on, so the two always agree
+		int hits = swarm->mField->getLevel().move(swarm->mX[i], swarm->mY[i], body, dx * swarm->speed, fall);
+		swarm->mGrounded[i] = (hits & HIT_BOTTOM) != 0;
+		swarm->mFall[i] = (hits & (HIT_BOTTOM | HIT_TOP)) ? 0 : fall;
+	}
+}
+
+int Swarm::getCount() const
+{
+	return (int)mX.size();
+}
+
+int Swarm::getX(int i) const
+{
+	return mX[i];
+}
+
+int Swarm::getY(int i) const
+{
+	return mY[i];
+}
+
+//What a behaviour script can read about its enemy
+enum Sensor { SENSOR_PLAYER_DX, SENSOR_PLAYER_DY, SENSOR_GROUND, SENSOR_BLOCKED, SENSOR_FLOW_X, SENSOR_FLOW_Y, SENSOR_RANDOM, SENSOR_COUNT };
+
+//Registers of a behaviour script
+const int BEHAVIOUR_REGISTERS = 8;
+
+//Per enemy state of a behaviour script, kept in one array for all enemies
+struct BehaviourState{
+	//Next instruction and first instruction of the script
+	int pc;
+	int entry;
+	//Frames left to sleep
+	int wait;
+	int regs[BEHAVIOUR_REGISTERS];
+	//Filled in by the game before every run
+	int inputs[SENSOR_COUNT];
+	//Read by the game after every run
+	int walk;
+	int jump;
+	Uint32 seed;
+};
+
+//Register based interpreter for the enemy behaviour scripts
+class BehaviourVM{
+public:
+	//Compiles the scripts of a behaviour file
+	bool load(std::string path);
+
+	//Compiles script source, name is used in error messages
+	bool compile(const std::string& source, std::string name);
+
+	//Finds the first instruction of a script, -1 if there is none
+	int find(std::string script) const;
+
+	//Resets a state to the start of a script
+	void start(BehaviourState& state, int entry, Uint32 seed) const;
+
+	//Runs every state until it yields for this frame
+	void run(BehaviourState* states, int count) const;
+private:
+	enum Opcode { OP_SET, OP_ADD, OP_SUB, OP_MUL, OP_SENSE, OP_JMP, OP_JLT, OP_JGE, OP_JEQ, OP_JNE, OP_WALK, OP_JUMP, OP_WAIT, OP_YIELD, OP_END };
+	//Marks a source operand that is the immediate value
+	static const Uint8 IMMEDIATE = 0xFF;
+	//Instructions an enemy may run in one frame before it is forced to yield
+	static const int MAX_STEPS = 64;
+
+	struct Instruction{
+		Uint8 op;
+		//Destination and first source register
+		Uint8 a;
+		Uint8 b;
+		//Second source register or IMMEDIATE
+		Uint8 c;
+		Sint32 value;
+		Sint32 target;
+	};
+
+	//Jump waiting for its label
+	struct Fixup{
+		size_t instruction;
+		std::string label;
+		int line;
+	};
+
+	//Parses a register name, -1 if it is not one
+	static int parse_register(const std::string& token);
+
+	//Clamps the result of arithmetic done in 64 bits to a register
+	static int saturate(Sint64 value);
+
+	//Terminates the script being compiled and patches its jumps
+	bool end_script(std::string name);
+
+	std::vector<Instruction> mCode;
+	std::map<std::string, int> mScripts;
+	//Labels and jumps of the script being compiled
+	std::map<std::string, int> mLabels;
+	std::vector<Fixup> mFixups;
+};
+
+int BehaviourVM::parse_register(const std::string& token)
+{
+	if (token.size() == 2 && token[0] == 'r' && token[1] >= '0' && token[1] < '0' + BEHAVIOUR_REGISTERS)
+		return token[1] - '0';
+	return -1;
+}
+
+int BehaviourVM::saturate(Sint64 value)
+{
+	return value > INT_MAX ? INT_MAX : value < INT_MIN ? INT_MIN : (int)value;
+}
+
+bool BehaviourVM::load(std::string path)
+{
+	SDL_RWops* file = gAssets.open_asset(path);
+	if (file == NULL)
+	{
+		printf("Unable to load behaviours %s! SDL Error: %s\n", path.c_str(), SDL_GetError());
+		return false;
+	}
+	Uint64 decodeStart = SDL_GetPerformanceCounter();
+	std::string source((size_t)SDL_RWsize(file), '\0');
+	size_t read = source.empty() ? 0 : SDL_RWread(file, &source[0], 1, source.size());
+	SDL_RWclose(file);
+	source.resize(read);
+	bool compiled = compile(source, path);
+	gStartup.asset(path, (Sint64)source.size(), SDL_GetPerformanceCounter() - decodeStart, 0);
+	return compiled;
+}
+
+bool BehaviourVM::compile(const std::string& source, std::string name)
+{
+	static const char* opcodes[] = { "set", "add", "sub", "mul", "sense", "jmp", "jlt", "jge", "jeq", "jne", "walk", "jump", "wait", "yield" };
+	static const char* sensors[] = { "player_dx", "player_dy", "ground", "blocked", "flow_x", "flow_y", "random" };
+
+	//Labels are local to a script, jumps are patched when it ends
+	mLabels.clear();
+	mFixups.clear();
+	bool inScript = false;
+	int line = 0;
+	size_t position = 0;
+	while (position < source.size()){
+		size_t end = source.find('\n', position);
+		if (end == std::string::npos)
+			end = source.size();
+		std::string text = source.substr(position, end - position);
+		position = end + 1;
+		line++;
+
+		//Split into words, '#' starts a comment
+		std::vector<std::string> words;
+		std::string word;
+		for (size_t i = 0; i <= text.size(); i++){
+			char c = i < text.size() ? text[i] : ' ';
+			if (c == '#')
+				c = '\0';
+			if (c == ' ' || c == '\t' || c == '\r' || c == ',' || c == '\0'){
+				if (!word.empty())
+					words.push_back(word);
+				word.clear();
+				if (c == '\0')
+					break;
+			}
+			else
+				word += c;
+		}
+
+		if (words.empty())
+			continue;
+		if (words[0] == "behaviour"){
+			//A new script closes the previous one
+			if (inScript && !end_script(name))
+				return false;
+			if (words.size() != 2){
+				printf("%s:%d: expected 'behaviour <name>'\n", name.c_str(), line);
+				return false;
+			}
+			if (mScripts.count(words[1]) != 0){
+				printf("%s:%d: behaviour '%s' is already defined\n", name.c_str(), line, words[1].c_str());
+				return false;
+			}
+			mScripts[words[1]] = (int)mCode.size();
+			inScript = true;
+			continue;
+		}
+		if (!inScript){
+			printf("%s:%d: code outside of a behaviour\n", name.c_str(), line);
+			return false;
+		}
+		if (words.size() == 1 && words[0][words[0].size() - 1] == ':'){
+			mLabels[words[0].substr(0, words[0].size() - 1)] = (int)mCode.size();
+			continue;
+		}
+
+		int op = -1;
+		for (int i = 0; i < (int)(sizeof(opcodes) / sizeof(opcodes[0])); i++){
+			if (words[0] == opcodes[i])
+				op = i;
+		}
+		if (op < 0){
+			printf("%s:%d: unknown instruction '%s'\n", name.c_str(), line, words[0].c_str());
+			return false;
+		}
+
+		//Operand shapes: d = destination register, r = register, s = register or number, n = sensor, l = label
+		static const char* shapes[] = { "ds", "drs", "drs", "drs", "dn", "l", "rsl", "rsl", "rsl", "rsl", "s", "s", "s", "" };
+		const char* shape = shapes[op];
+		if (words.size() - 1 != strlen(shape)){
+			printf("%s:%d: '%s' takes %d operands\n", name.c_str(), line, words[0].c_str(), (int)strlen(shape));
+			return false;
+		}
+		Instruction instruction = { (Uint8)op, 0, 0, IMMEDIATE, 0, 0 };
+		int registers = 0;
+		for (size_t i = 0; i < strlen(shape); i++){
+			const std::string& operand = words[i + 1];
+			int reg = parse_register(operand);
+			if (shape[i] == 'd' || shape[i] == 'r'){
+				if (reg < 0){
+					printf("%s:%d: expected a register, got '%s'\n", name.c_str(), line, operand.c_str());
+					return false;
+				}
+				if (registers++ == 0)
+					instruction.a = (Uint8)reg;
+				else
+					instruction.b = (Uint8)reg;
+			}
+			else if (shape[i] == 's'){
+				char* last = NULL;
+				errno = 0;
+				long long number = strtoll(operand.c_str(), &last, 10);
+				if (reg >= 0)
+					instruction.c = (Uint8)reg;
+				else if (*last == '\0' && !operand.empty() && errno == 0 && number >= INT_MIN && number <= INT_MAX)
+					instruction.value = (Sint32)number;
+				else{
+					printf("%s:%d: expected a register or number, got '%s'\n", name.c_str(), line, operand.c_str());
+					return false;
+				}
+			}
+			else if (shape[i] == 'n'){
+				int sensor = -1;
+				for (int s = 0; s < SENSOR_COUNT; s++){
+					if (operand == sensors[s])
+						sensor = s;
+				}
+				if (sensor < 0){
+					printf("%s:%d: unknown input '%s'\n", name.c_str(), line, operand.c_str());
+					return false;
+				}
+				instruction.value = sensor;
+			}
+			else if (shape[i] == 'l'){
+				Fixup fixup = { mCode.size(), operand, line };
+				mFixups.push_back(fixup);
+			}
+		}
+		mCode.push_back(instruction);
+	}
+	return !inScript || end_script(name);
+}
+
+bool BehaviourVM::end_script(std::string name)
+{
+	//Running off the end restarts the script next frame
+	Instruction end = { OP_END, 0, 0, IMMEDIATE, 0, 0 };
+	mCode.push_back(end);
+	for (size_t i = 0; i < mFixups.size(); i++){
+		std::map<std::string, int>::iterator label = mLabels.find(mFixups[i].label);
+		if (label == mLabels.end()){
+			printf("%s:%d: unknown label '%s'\n", name.c_str(), mFixups[i].line, mFixups[i].label.c_str());
+			return false;
+		}
+		mCode[mFixups[i].instruction].target = label->second;
+	}
+	mLabels.clear();
+	mFixups.clear();
+	return true;
+}
+
+int BehaviourVM::find(std::string script) const
+{
+	std::map<std::string, int>::const_iterator found = mScripts.find(script);
+	return found != mScripts.end() ? found->second : -1;
+}
+
+void BehaviourVM::start(BehaviourState& state, int entry, Uint32 seed) const
+{
+	memset(&state, 0, sizeof(state));
+	state.pc = entry;
+	state.entry = entry;
+	state.seed = seed != 0 ? seed : 1;
+}
+
+void BehaviourVM::run(BehaviourState* states, int count) const
+{
+	if (mCode.empty())
+		return;
+	const Instruction* code = &mCode[0];
+	for (int i = 0; i < count; i++){
+		BehaviourState& state = states[i];
+		state.jump = 0;
+		if (state.entry < 0)
+			continue;
+		if (state.wait > 0){
+			state.wait--;
+			continue;
+		}
+		int* r = state.regs;
+		int pc = state.pc;
+		for (int steps = MAX_STEPS; steps > 0; steps--){
+			const Instruction& instruction = code[pc++];
+			int source = instruction.c == IMMEDIATE ? instruction.value : r[instruction.c];
+			switch (instruction.op){
+			case OP_SET: r[instruction.a] = source; break;
+			//Scripts saturate instead of overflowing
+			case OP_ADD: r[instruction.a] = saturate((Sint64)r[instruction.b] + source); break;
+			case OP_SUB: r[instruction.a] = saturate((Sint64)r[instruction.b] - source); break;
+			case OP_MUL: r[instruction.a] = saturate((Sint64)r[instruction.b] * source); break;
+			case OP_SENSE:
+				if (instruction.value == SENSOR_RANDOM){
+					//xorshift32, one stream per enemy
+					state.seed ^= state.seed << 13;
+					state.seed ^= state.seed >> 17;
+					state.seed ^= state.seed << 5;
+					r[instruction.a] = (int)(state.seed % 100);
+				}
+				else
+					r[instruction.a] = state.inputs[instruction.value];
+				break;
+			case OP_JMP: pc = instruction.target; break;
+			case OP_JLT: if (r[instruction.a] < source) pc = instruction.target; break;
+			case OP_JGE: if (r[instruction.a] >= source) pc = instruction.target; break;
+			case OP_JEQ: if (r[instruction.a] == source) pc = instruction.target; break;
+			case OP_JNE: if (r[instruction.a] != source) pc = instruction.target; break;
+			case OP_WALK: state.walk = source; break;
+			case OP_JUMP: state.jump = source; break;
+			case OP_WAIT: state.wait = source > 0 ? source - 1 : 0; steps = 0; break;
+			case OP_YIELD: steps = 0; break;
+			case OP_END: pc = state.entry; steps = 0; break;
+			}
+		}
+		state.pc = pc;
+	}
+}
+
+class Character{
+protected:
 	//Direction of character
 	char direction;
 public:
 	//The X and Y offsets character
 	int mPosX, mPosY;
-	void draw(SDL_Rect* src, int x, int y);
+	void draw(SDL_Rect* src, int x, int y, SDL_RendererFlip flip = SDL_FLIP_NONE);
 	SDL_Rect current_sprite;
-	Texture character_texture;
+	//Collision mask of current_sprite
+	const BitMask* current_mask;
+	//Collision masks of every frame
+	MaskSheet masks;
+	Texture character_texture;
+	//Box that collides with the terrain, relative to the position
+	SDL_Rect body;
 	bool onMove;
 	bool death;
 	//Moves the Player
@@ -196,15 +5443,9 @@ public:
 	float speed;
 };
 
-void Character::draw(SDL_Rect* src, int x, int y){
-	//Set rendering space and render to screen
-	SDL_Rect renderQuad = { mPosX - x, mPosY - y, character_texture.mWidth, character_texture.mHeight };
-	//Set clip rendering dimensions
-	if (src != NULL){
-		renderQuad.w = src->w;
-		renderQuad.h = src->h;
-	}
-	SDL_RenderCopy(gRenderer, character_texture.mTexture, src, &renderQuad);
+void Character::draw(SDL_Rect* src, int x, int y, SDL_RendererFlip flip){
+	//Render relative to the camera
+	character_texture.render(mPosX - x, mPosY - y, src, 0.0, NULL, flip);
 }
 
 void Character::isDead(){
@@ -235,25 +5476,54 @@ void Character::isRunning(){
 	onMove = 1;
 }
 
+//Everything a rollback restores of an enemy, the collision mask is looked up again
+struct EnemyState{
+	int x;
+	int y;
+	char direction;
+	bool death;
+	bool grounded;
+	bool blocked;
+	SDL_Rect current_sprite;
+	int frame;
+	int fall;
+	int shift;
+	int dying;
+};
+
 class Enemy : public Character{
 private:
 	Texture dog;
 	Texture mummy;
 	SDL_Rect dog_left[6];
-	SDL_Rect dog_right[6];
 	SDL_Rect mummy_move[5];
 	SDL_Rect mummy_death[5];
 	int frame;
 	int frameRate;
+	//Falling speed
+	int fall;
+	//Offset of the mirrored frame being drawn
+	int shift;
+	//Frames into the death animation
+	int dying;
 	
 public:
 	Enemy();
 	Enemy(int, int,char);
 	void load_sprite();
+	//Advances the walk cycle
+	void animate();
 	void draw_enemy();
-	void move();
-	bool collision(SDL_Rect player);
+	//Walks and jumps as the behaviour script asked
+	void move(int walk, int jump);
+	//Standing on the ground
+	bool grounded;
+	//Walked into a wall or stopped at a ledge last frame
+	bool blocked;
+	bool collision(SDL_Rect box, const BitMask* mask);
 	char enemy_type;
+	void save(EnemyState& state) const;
+	void load(const EnemyState& state);
 };
 
 Enemy::Enemy(){}
@@ -266,69 +5536,93 @@ Enemy::Enemy(int x, int y,char e_type){
 	mPosY = y;
 	enemy_type = e_type;
 	speed = 2;
+	current_sprite.x = 0;
+	current_sprite.y = 0;
+	current_sprite.w = 0;
+	current_sprite.h = 0;
+	current_mask = NULL;
+	fall = 0;
+	shift = 0;
+	dying = 0;
+	grounded = false;
+	blocked = false;
+	direction = 'l';
+	//Feet of the sprites touch the bottom of the body
+	if (enemy_type == 'd'){
+		body.x = 8; body.y = 2; body.w = 60; body.h = 40;
+	}
+	else{
+		body.x = 2; body.y = 2; body.w = 44; body.h = 59;
+	}
 }
 
-bool Enemy::collision(SDL_Rect player){
-	//The sides of the rectangles
-	int leftA, leftB;
-	int rightA, rightB;
-	int topA, topB;
-	int bottomA, bottomB;
-
-	//Calculate the sides of rect A
-	leftA = player.x;
-	rightA = player.x + player.w-65;
-	topA = player.y;
-	bottomA = player.y + player.h-16;
-	
-	//Calculate the sides of rect B
-	leftB = mPosX;
-	rightB = mPosX+47;
-	topB = mPosY;
-	bottomB = mPosY+62;
-
-	//If any of the sides from A are outside of B
-	if (bottomA <= topB )
-	{
-		return false;
-	}
-
-	if (topA >= bottomB)
-	{
-		return false;
-	}
-
-	if (rightA <= leftB)
-	{
- 		return false;
-	}
-
-	if (leftA >= rightB)
-	{
-		return false;
-	}
-	//If none of the sides from A are outside B
+bool Enemy::collision(SDL_Rect box, const BitMask* mask){
+	//The sides of the rectangles
+	int leftA, leftB;
+	int rightA, rightB;
+	int topA, topB;
+	int bottomA, bottomB;
+
+	//Calculate the sides of rect A
+	leftA = box.x;
+	rightA = box.x + box.w;
+	topA = box.y;
+	bottomA = box.y + box.h;
+	
+	//Calculate the sides of rect B
+	leftB = mPosX + shift;
+	rightB = mPosX + shift + current_sprite.w;
+	topB = mPosY;
+	bottomB = mPosY + current_sprite.h;
+
+	//If any of the sides from A are outside of B
+	if (bottomA <= topB )
+	{
+		return false;
+	}
+
+	if (topA >= bottomB)
+	{
+		return false;
+	}
+
+	if (rightA <= leftB)
+	{
+ 		return false;
+	}
+
+	if (leftA >= rightB)
+	{
+		return false;
+	}
+	//Boxes overlap, compare the opaque pixels when both masks are known
+	if (mask != NULL && current_mask != NULL)
+	{
+		return BitMask::overlap(mask, box.x, box.y, current_mask, mPosX + shift, mPosY);
+	}
+	//If none of the sides from A are outside B
 	return true;
 }
 
 void Enemy::load_sprite(){
 	if (enemy_type == 'd'){
-		dog.load_image("assets/dog.png");
+		dog.load_image("assets/dog.png", true);
 		int x = 0, y = 70, w = 76, h = 45;
 		for (int i = 0; i < 6; i++){
-			y = 70;
 			dog_left[i].x = x; dog_left[i].y = y;
 			dog_left[i].w = w; dog_left[i].h = h;
-			y += 117;
-			dog_right[i].x = x; dog_right[i].y = y;
-			dog_right[i].w = w; dog_right[i].h = h;
 			x += 118;
 			if (x > 590)
 				x = 0;
 		}
+		//A right facing dog would be dog_left mirrored
+		if (dog.getWidth() == DOG_SHEET.getWidth() && dog.getHeight() == DOG_SHEET.getHeight())
+			DOG_SHEET.remap(dog_left, 6);
+		masks.build(dog, dog_left, 6);
+		dog.free_pixels();
 	}
 	else if (enemy_type == 'm'){
-		mummy.load_image("assets/mummy.png");
+		mummy.load_image("assets/mummy.png", true);
 		int x1 = 5, y1 = 50, w1 = 47, h1 = 62;
 		for (int i = 0; i < 5; i++){
 			y1 = 50;
@@ -341,33 +5635,131 @@ void Enemy::load_sprite(){
 			if (x1 > 340)
 				x1 = 0;
 		}
+		masks.build(mummy, mummy_move, 5);
+		masks.build(mummy, mummy_death, 5);
+		mummy.free_pixels();
 	}
 }
 
-void Enemy::draw_enemy(){
+void Enemy::animate(){
+	//The sheets face left, walking right is drawn mirrored
+	bool mirrored = direction == 'r';
 	if (death == 0){
 		if (enemy_type == 'd'){
 			current_sprite = dog_left[frame / frameRate];
 			frame++;
 			if (frame > 59)
 				frame = 0;
-			dog.render(mPosX, mPosY, &current_sprite, 0, 0, SDL_FLIP_NONE);
 		}
 		else if (enemy_type == 'm'){
 			current_sprite = mummy_move[frame / frameRate];
 			frame++;
 			if (frame > 49)
 				frame = 0;
-			//draw(&current_sprite, camera.x, camera.y);
-			mummy.render(mPosX, mPosY, &current_sprite, 0, 0, SDL_FLIP_NONE);
 		}
+		shift = mirrored ? masks.mirror_shift(current_sprite) : 0;
+		current_mask = masks.find(current_sprite, mirrored);
+	}
+	//Mummies crumble once before they are gone
+	else if (enemy_type == 'm' && dying < 5 * frameRate){
+		current_sprite = mummy_death[dying / frameRate];
+		dying++;
+		shift = mirrored ? masks.mirror_shift(current_sprite) : 0;
+		current_mask = masks.find(current_sprite, mirrored);
+	}
+}
+
+void Enemy::draw_enemy(){
+	if (death == 0 || (enemy_type == 'm' && dying > 0 && dying < 5 * frameRate)){
+		SDL_RendererFlip flip = direction == 'r' ? SDL_FLIP_HORIZONTAL : SDL_FLIP_NONE;
+		Texture& sheet = enemy_type == 'd' ? dog : mummy;
+		sheet.render(mPosX - camera.x + shift, mPosY - camera.y, &current_sprite, 0, 0, flip);
 	}
-	/*draw(&current_sprite, camera.x, camera.y);*/
 }
 
-void Enemy::move(){
-	mPosX -= speed;
+void Enemy::save(EnemyState& state) const{
+	state.x = mPosX;
+	state.y = mPosY;
+	state.direction = direction;
+	state.death = death;
+	state.grounded = grounded;
+	state.blocked = blocked;
+	state.current_sprite = current_sprite;
+	state.frame = frame;
+	state.fall = fall;
+	state.shift = shift;
+	state.dying = dying;
+}
+
+void Enemy::load(const EnemyState& state){
+	mPosX = state.x;
+	mPosY = state.y;
+	direction = state.direction;
+	death = state.death;
+	grounded = state.grounded;
+	blocked = state.blocked;
+	current_sprite = state.current_sprite;
+	frame = state.frame;
+	fall = state.fall;
+	shift = state.shift;
+	dying = state.dying;
+	current_mask = masks.find(current_sprite, direction == 'r');
 }
+
+void Enemy::move(int walk, int jump){
+	if (death == 1)
+		return;
+	if (walk != 0)
+		direction = walk > 0 ? 'r' : 'l';
+	//Wait at the edge of a ledge instead of walking off
+	int dx = walk;
+	int front = dx < 0 ? mPosX + body.x + dx : mPosX + body.x + body.w - 1 + dx;
+	bool ledge = dx != 0 && grounded && !gLevel.floor_at(front, mPosY + body.y + body.h);
+	if (ledge)
+		dx = 0;
+	if (jump > 0 && grounded)
+		fall = -jump;
+	else if (fall < GRAVITY)
+		fall++;
+	int hits = gLevel.move(mPosX, mPosY, body, dx, fall);
+	grounded = (hits & HIT_BOTTOM) != 0;
+	if (hits & (HIT_BOTTOM | HIT_TOP))
+		fall = 0;
+	blocked = ledge || (hits & (HIT_LEFT | HIT_RIGHT)) != 0;
+	//Fell out of the level
+	if (mPosY > LEVEL_HEIGHT)
+		isDead();
+}
+//Buttons of a player, one bit each so a frame of input is a byte
+enum PlayerButton { BUTTON_LEFT = 1, BUTTON_RIGHT = 2, BUTTON_JUMP = 4, BUTTON_ATTACK = 8, BUTTON_POWER = 16 };
+
+//Everything a rollback restores of a player, the collision masks are looked up again
+struct PlayerState{
+	int x;
+	int y;
+	char direction;
+	char shotDirection;
+	bool onMove;
+	bool death;
+	bool onGround;
+	bool onJump;
+	bool onAttack;
+	bool onPower;
+	bool attacked;
+	float speed;
+	SDL_Rect current_sprite;
+	SDL_Rect collisionTest;
+	SDL_Rect shoot_collision;
+	int Jump_Height;
+	int blast;
+	int blastX;
+	int blastY;
+	int shotX;
+	int shotY;
+	int height;
+	int sprite;
+};
+
 class Player: public Character{
 public:
 	//The dimensions of the Player
@@ -375,6 +5767,8 @@ public:
 	static const int Player_HEIGHT = 20;
 	SDL_Rect collisionTest;
 	SDL_Rect shoot_collision;
+	//Collision mask of the shot
+	const BitMask* shoot_mask;
 	//Initializes the variables
 	Player();
 
@@ -383,6 +5777,13 @@ public:
 	void load_sprites();
 	//Takes key presses and adjusts the Player's velocity
 	void handleEvent(SDL_Event& e);
+	//Buttons pressed by the newest event
+	static Uint8 read_input(const SDL_Event& e);
+	//Buttons held down on the keyboard
+	static Uint8 read_keys();
+	void apply_input(Uint8 buttons);
+	//Advances the animation, launches and moves the shot
+	void animate();
 	void draw_image();
 	void playerPosition();
 	void enemy_collision();
@@ -390,7 +5791,9 @@ public:
 	bool collideScreen_right();
 	//Shows the Player on the screen relative to the camera
 	void render(int camX, int camY);
-	void shoot(SDL_Rect* src, int x, int y);
+	void move_shot();
+	void save(PlayerState& state) const;
+	void load(const PlayerState& state);
 	bool onGround;
 	bool onJump;
 	int frame;
@@ -399,26 +5802,29 @@ public:
 	bool onPower;
 	int Jump_Height;
 	bool attacked;
-	static int blast;
+	int blast;
 	int blastX;
 	int blastY;
+	//Shot position in the level and its direction
+	int shotX;
+	int shotY;
+	char shotDirection;
+	SDL_Rect shotBody;
 private:
-	SDL_Rect idle_left[4];
+	//Right facing frames, left facing is drawn mirrored
 	SDL_Rect idle_right[4];
-	SDL_Rect run_left[4];
 	SDL_Rect run_right[4];
-	SDL_Rect jump_left[4];
 	SDL_Rect jump_right[4];
-	SDL_Rect power_left[4];
 	SDL_Rect power_right[4];
-	SDL_Rect attack_left[2];
 	SDL_Rect attack_right[2];
-	SDL_Rect hurt_left[3];
 	SDL_Rect hurt_right[3];
 	//SDL_Rect spawn_sprite;
+	//Frames into the jump
+	int height;
+	//Frames into the animation
+	int sprite;
 };
 
-int Player::blast = 55;
 Player::Player()
 {
 	speed = 3;
@@ -430,7 +5836,12 @@ Player::Player()
 	collisionTest.x = mPosX;
 	collisionTest.y = mPosY;
 	collisionTest.w = 115;
-	collisionTest.h = 120;
+	collisionTest.h = 120;
+	current_sprite.x = 0;
+	current_sprite.y = 0;
+	current_sprite.w = 0;
+	current_sprite.h = 0;
+	shoot_collision = current_sprite;
 	onAttack = 0;
 	onPower = 0;
 	direction = 'r';
@@ -439,6 +5850,21 @@ Player::Player()
 	onJump = 0;
 	death = 0;
 	attacked = 0;
+	blast = 55;
+	blastX = 0;
+	blastY = 0;
+	height = 0;
+	sprite = 0;
+	Jump_Height = 0;
+	current_mask = NULL;
+	shoot_mask = NULL;
+	body.x = 8;	body.y = 4;
+	body.w = 48;	body.h = 104;
+	shotX = 0;
+	shotY = 0;
+	shotDirection = 'r';
+	shotBody.x = 4;	shotBody.y = 12;
+	shotBody.w = 66;	shotBody.h = 36;
 	/*spawn_sprite = { NULL, NULL, NULL, NULL };*/
 }
 
@@ -472,213 +5898,286 @@ void Player::enemy_collision(){
 	isDead();
 }
 
-void Player::shoot(SDL_Rect* src, int x, int y){
-	SDL_Rect renderQuad;
-	//Set rendering space and render to screen
-	if (direction == 'r'){
-		renderQuad = { mPosX - x + blast, startPosY - y + 45, character_texture.mWidth, character_texture.mHeight };
-		blast += 4;
-		blastX = mPosX - x + blast;
-		blastY = mPosY - y + 45;
-	}
-	else if (direction == 'l'){
-		renderQuad = { mPosX - x - blast, startPosY - y + 45, character_texture.mWidth, character_texture.mHeight };
-		blast += 4;
-		blastX = mPosX - x + blast;
-		blastY = mPosY - y + 45;
-	}
-	if (blast > 600){
+void Player::move_shot(){
+	//Fly until the shot hits a wall or runs out of range
+	int hits = gLevel.move(shotX, shotY, shotBody, shotDirection == 'r' ? SHOT_SPEED : -SHOT_SPEED, 0);
+	blast += SHOT_SPEED;
+	blastX = shotX;
+	blastY = shotY;
+	if (blast > 600 || hits != HIT_NONE){
 		blast = 0;
 		attacked = 0;
 	}
 	shoot_collision.x = blastX;
 	shoot_collision.y = blastY;
-	//Set clip rendering dimensions
-	if (src != NULL){
-		renderQuad.w = src->w;
-		renderQuad.h = src->h;
-	}
-	SDL_RenderCopy(gRenderer, character_texture.mTexture, src, &renderQuad);
-}
-
-void Player::playerPosition(){
-	static int height = 0;
-	if (onJump != 0){
-		height++;
-		if (height == 4 || height == 6 || height == 10 || height == 18 || height == 45 || height == 50){
-			Jump_Height--;
-		}
-		if (Jump_Height <= 0){
-			onJump = 0;
-			Jump_Height = 0;
-			height = 0;
-			onGround = 0;
-		}
-		
-		mPosY -= Jump_Height;
-		collisionTest.y = mPosY;
-	}
-	if (onGround != 1 && onJump != 1 ){
-		if (Jump_Height < GRAVITY){
-			Jump_Height += 1;
-		}
-		else{
-			Jump_Height = GRAVITY;
-		}
-		mPosY += Jump_Height;
-	}
-	if (mPosY >= 550){
-		onGround = 1;
+}
+
+void Player::playerPosition(){
+	int dy = 0;
+	if (onJump != 0){
+		height++;
+		if (height == 4 || height == 6 || height == 10 || height == 18 || height == 45 || height == 50){
+			Jump_Height--;
+		}
+		if (Jump_Height <= 0){
+			onJump = 0;
+			Jump_Height = 0;
+			height = 0;
+			onGround = 0;
+		}
+		
+		dy = -Jump_Height;
 	}
+	if (onGround != 1 && onJump != 1 ){
+		if (Jump_Height < GRAVITY){
+			Jump_Height += 1;
+		}
+		else{
+			Jump_Height = GRAVITY;
+		}
+		dy = Jump_Height;
+	}
+	else if (onGround == 1){
+		//Keep pressing on the floor so walking off a ledge is noticed
+		dy = 1;
+	}
+	int dx = 0;
 	if (onMove == 1 && direction == 'r')
-		mPosX += speed;
+		dx = (int)speed;
 	if (onMove == 1 && direction == 'l')
-		mPosX -= speed;
-	if (mPosX < 1){
-		speed = 0;
-		mPosX++;
+		dx = -(int)speed;
+
+	//Resolve the move against the terrain
+	int hits = gLevel.move(mPosX, mPosY, body, dx, dy);
+	if (hits & HIT_BOTTOM){
+		onGround = 1;
+		Jump_Height = 0;
+	}
+	else if (onJump != 1){
+		onGround = 0;
+	}
+	if ((hits & HIT_TOP) && onJump == 1){
+		//Bumped the head, start falling
+		onJump = 0;
+		Jump_Height = 0;
+		height = 0;
 	}
-	else if (onPower != 1)
+	//Fell into a pit
+	if (mPosY > LEVEL_HEIGHT)
+		isDead();
+
+	if (onPower != 1)
 		speed = 3;
 	else if (onPower == 1){
 		speed = 6;
 	}
-	collisionTest.y = mPosY;
 
 }
 
 void Player::handleEvent(SDL_Event& e)
 {
-	onMove = 0;
+	apply_input(read_input(e));
+}
+
+Uint8 Player::read_input(const SDL_Event& e)
+{
 	//If a key was pressed
-	if (e.type == SDL_KEYDOWN)
-	{
-		//Adjust the velocity
-		if (e.key.keysym.sym == SDLK_UP && onJump != 1)
-			isJumping();
-		if (e.key.keysym.sym == SDLK_LEFT)
-			move_left();
-		if (e.key.keysym.sym == SDLK_RIGHT)
-			move_right();
-		if (e.key.keysym.sym == SDLK_SPACE){
-			if (onAttack == 0 && attacked == 0 && onJump != 1)
-				isAttacking();
-		}
-		if (e.key.keysym.sym == SDLK_LCTRL){
-			onPower = 1;
-			speed = 6;
-		}
+	if (e.type != SDL_KEYDOWN)
+		return 0;
+	switch (e.key.keysym.sym){
+	case SDLK_LEFT: return BUTTON_LEFT;
+	case SDLK_RIGHT: return BUTTON_RIGHT;
+	case SDLK_UP: return BUTTON_JUMP;
+	case SDLK_SPACE: return BUTTON_ATTACK;
+	case SDLK_LCTRL: return BUTTON_POWER;
+	default: return 0;
 	}
 }
 
-void Player::draw_image(){
-	static int sprite = 0;
+Uint8 Player::read_keys()
+{
+	const Uint8* keys = SDL_GetKeyboardState(NULL);
+	Uint8 buttons = 0;
+	if (keys[SDL_SCANCODE_LEFT])
+		buttons |= BUTTON_LEFT;
+	if (keys[SDL_SCANCODE_RIGHT])
+		buttons |= BUTTON_RIGHT;
+	if (keys[SDL_SCANCODE_UP])
+		buttons |= BUTTON_JUMP;
+	if (keys[SDL_SCANCODE_SPACE])
+		buttons |= BUTTON_ATTACK;
+	if (keys[SDL_SCANCODE_LCTRL])
+		buttons |= BUTTON_POWER;
+	return buttons;
+}
+
+void Player::apply_input(Uint8 buttons)
+{
+	onMove = 0;
+	//Adjust the velocity
+	if ((buttons & BUTTON_JUMP) && onJump != 1)
+		isJumping();
+	if (buttons & BUTTON_LEFT)
+		move_left();
+	if (buttons & BUTTON_RIGHT)
+		move_right();
+	if (buttons & BUTTON_ATTACK){
+		if (onAttack == 0 && attacked == 0 && onJump != 1)
+			isAttacking();
+	}
+	if (buttons & BUTTON_POWER){
+		onPower = 1;
+		speed = 6;
+	}
+}
+
+void Player::animate(){
 	if (death == 1){
-		if (direction == 'r')
-			current_sprite = hurt_right[sprite / (frame_rate+10)];
-		else if (direction == 'l')
-			current_sprite = hurt_left[sprite / (frame_rate + 10)];
+		current_sprite = hurt_right[sprite / (frame_rate+10)];
 	}
 	else{
-		if (onMove == 1){
-			if (direction == 'r')
-				current_sprite = run_right[sprite / frame_rate];
-			else if (direction == 'l')
-				current_sprite = run_left[sprite / frame_rate];
-		}
-		else if (onMove == 0){
-			if (direction == 'r')
-				current_sprite = idle_right[sprite / frame_rate];
-			else if (direction == 'l')
-				current_sprite = idle_left[sprite / frame_rate];
-		}
-		if (onJump == 1 || onGround == 0){
-			if (direction == 'r')
-				current_sprite = jump_right[sprite / frame_rate];
-			else if (direction == 'l')
-				current_sprite = jump_left[sprite / frame_rate];
-			if (sprite > 25){
-				sprite = 0;
-			}
-		}
-		if (onMove == 1 && onPower == 1){
-			if (direction == 'r')
-				current_sprite = power_right[sprite /frame_rate];
-			if (direction == 'l')
-				current_sprite = power_left[sprite /frame_rate];
-			if (sprite > 28)
-				sprite = 0;
-		}
-		if (onAttack == 1 && attacked != 1 && onJump != 1 && onGround != 0){
-			if (direction == 'r')
-				current_sprite = attack_right[sprite /(20+frame_rate)];
-			if (direction == 'l')
-				current_sprite = attack_left[sprite /(20+ frame_rate)];
-			if (sprite > 25)
-				sprite = 0;
-			if (sprite == 25)
-				attacked = 1;
-		}
-	}
-	sprite++;
-	if (sprite > 39)
+		if (onMove == 1){
+			current_sprite = run_right[sprite / frame_rate];
+		}
+		else if (onMove == 0){
+			current_sprite = idle_right[sprite / frame_rate];
+		}
+		if (onJump == 1 || onGround == 0){
+			current_sprite = jump_right[sprite / frame_rate];
+			if (sprite > 25){
+				sprite = 0;
+			}
+		}
+		if (onMove == 1 && onPower == 1){
+			current_sprite = power_right[sprite /frame_rate];
+			if (sprite > 28)
+				sprite = 0;
+		}
+		if (onAttack == 1 && attacked != 1 && onJump != 1 && onGround != 0){
+			current_sprite = attack_right[sprite /(20+frame_rate)];
+			if (sprite > 25)
+				sprite = 0;
+			if (sprite == 25){
+				attacked = 1;
+				//Launch the shot in front of the player
+				shotDirection = direction;
+				shotX = direction == 'r' ? mPosX + 55 : mPosX - 55;
+				shotY = mPosY + 45;
+				blast = 0;
+			}
+		}
+	}
+	sprite++;
+	if (sprite > 39)
 		sprite = 0;
-
-	if (sprite == 0)
+
+	if (sprite == 0)
 		onAttack = 0;
-	draw(&current_sprite, camera.x, camera.y);
+	//Facing left is the right facing frame mirrored
+	bool mirrored = direction == 'l';
+	int shift = mirrored ? masks.mirror_shift(current_sprite) : 0;
+	//Collide with the frame exactly where it is drawn
+	current_mask = masks.find(current_sprite, mirrored);
+	collisionTest.x = mPosX + shift;
+	collisionTest.y = mPosY;
+	collisionTest.w = current_sprite.w;
+	collisionTest.h = current_sprite.h;
 	if (attacked == 1){
-		if (direction == 'r'){
-			shoot(&attack_right[1], camera.x, camera.y);
-		}
-		else if (direction == 'l'){
-			shoot(&attack_left[1], camera.x, camera.y);
-		}
+		move_shot();
+		shoot_mask = masks.find(attack_right[1], shotDirection == 'l');
+	}
+}
+
+void Player::draw_image(){
+	SDL_RendererFlip flip = direction == 'l' ? SDL_FLIP_HORIZONTAL : SDL_FLIP_NONE;
+	int shift = flip == SDL_FLIP_HORIZONTAL ? masks.mirror_shift(current_sprite) : 0;
+	draw(&current_sprite, camera.x - shift, camera.y, flip);
+	if (attacked == 1){
+		//Shots to the left use the right facing frame mirrored
+		character_texture.render(shotX - camera.x, shotY - camera.y, &attack_right[1], 0.0, NULL, shotDirection == 'l' ? SDL_FLIP_HORIZONTAL : SDL_FLIP_NONE);
 	}
 }
 
+void Player::save(PlayerState& state) const{
+	state.x = mPosX;
+	state.y = mPosY;
+	state.direction = direction;
+	state.shotDirection = shotDirection;
+	state.onMove = onMove;
+	state.death = death;
+	state.onGround = onGround;
+	state.onJump = onJump;
+	state.onAttack = onAttack;
+	state.onPower = onPower;
+	state.attacked = attacked;
+	state.speed = speed;
+	state.current_sprite = current_sprite;
+	state.collisionTest = collisionTest;
+	state.shoot_collision = shoot_collision;
+	state.Jump_Height = Jump_Height;
+	state.blast = blast;
+	state.blastX = blastX;
+	state.blastY = blastY;
+	state.shotX = shotX;
+	state.shotY = shotY;
+	state.height = height;
+	state.sprite = sprite;
+}
+
+void Player::load(const PlayerState& state){
+	mPosX = state.x;
+	mPosY = state.y;
+	direction = state.direction;
+	shotDirection = state.shotDirection;
+	onMove = state.onMove;
+	death = state.death;
+	onGround = state.onGround;
+	onJump = state.onJump;
+	onAttack = state.onAttack;
+	onPower = state.onPower;
+	attacked = state.attacked;
+	speed = state.speed;
+	current_sprite = state.current_sprite;
+	collisionTest = state.collisionTest;
+	shoot_collision = state.shoot_collision;
+	Jump_Height = state.Jump_Height;
+	blast = state.blast;
+	blastX = state.blastX;
+	blastY = state.blastY;
+	shotX = state.shotX;
+	shotY = state.shotY;
+	height = state.height;
+	sprite = state.sprite;
+	current_mask = masks.find(current_sprite, direction == 'l');
+	shoot_mask = masks.find(attack_right[1], shotDirection == 'l');
+}
+
 void Player::load_sprites(){
 	int Frame = 4;
-	character_texture.load_image("assets/player.png");
+	character_texture.load_image("assets/player.png", true);
 	int x3 = 0, y3 = 0, w3 = 115, h3 = 120;
 	int yDifference = 117;
 	for (int i = 0; i < Frame; i++){
 		y3 = 0;
 		idle_right[i].x = x3;				idle_right[i].y = y3;
 		idle_right[i].w = w3;				idle_right[i].h = h3;
-		y3 += yDifference;
-		idle_left[Frame - i - 1].x = x3;		idle_left[Frame - i - 1].y = y3;
-		idle_left[Frame - i - 1].w = w3;		idle_left[Frame - i - 1].h = h3;
-		y3 += yDifference;
+		y3 += yDifference * 2;
 		run_right[i].x = x3;					run_right[i].y = y3;
 		run_right[i].w = w3;					run_right[i].h = h3;
-		y3 += yDifference;
-		run_left[Frame - i - 1].x = x3;		run_left[Frame - i - 1].y = y3;
-		run_left[Frame - i - 1].w = w3;		run_left[Frame - i - 1].h = h3;
-		y3 += yDifference+2;
+		y3 += yDifference * 2 + 2;
 		jump_right[i].x = x3;				jump_right[i].y = y3;
 		jump_right[i].w = w3;				jump_right[i].h = h3;
-		y3 += yDifference+3;
-		jump_left[Frame - i - 1].x = x3;		jump_left[Frame - i - 1].y = y3;
-		jump_left[Frame - i - 1].w = w3;		jump_left[Frame - i - 1].h = h3;
-		y3 += yDifference+5;
+		y3 += yDifference * 2 + 8;
 		power_right[i].x = x3+120;				power_right[i].y = y3;
 		power_right[i].w = w3;				power_right[i].h = h3;
-		y3 += yDifference+5;
-		power_left[Frame - i - 2].x = x3+122;	power_left[Frame - i - 2].y = y3;
-		power_left[Frame - i - 2].w = w3;	power_left[Frame - i - 2].h = h3;
 		x3 += 120;
 		if (x3 > 500)
 			x3 = 0;
 	}
 	int x = 0, y = 1192, h = 123, w = 60;
 	for (int i = 0; i < 3; i++){
-		y = 1192;
 		hurt_right[i].x = x;				hurt_right[i].y = y;
 		hurt_right[i].w = w;				hurt_right[i].h = h;
-		y += yDifference+7;
-		hurt_left[Frame - i - 2].x = x;		hurt_left[Frame - i - 2].y = y;
-		hurt_left[Frame - i - 2].w = w;		hurt_left[Frame - i - 2].h = h;
 		x += 122;
 		if (x>366)
 			x = 0;
@@ -686,28 +6185,51 @@ void Player::load_sprites(){
 	attack_right[0].x = 10; attack_right[0].y = 965;
 	attack_right[0].w = 112; attack_right[0].h = 100;
 
-	attack_left[0].x = 7; attack_left[0].y = 1082;
-	attack_left[0].w = 112; attack_left[0].h = 100;
-	
 	/*attack_right[1].x = 148; attack_right[1].y = 964;
-	attack_right[1].w = 56; attack_right[1].h = 100;
-	
-	attack_left[1].x = 144; attack_left[1].y = 1082;
-	attack_left[1].w = 56; attack_left[1].h = 100;*/
+	attack_right[1].w = 56; attack_right[1].h = 100;*/
 	
 	attack_right[1].x = 227; attack_right[1].y = 1009;
 	attack_right[1].w = 74; attack_right[1].h = 59;
 
-	attack_left[1].x = 228; attack_left[1].y = 1115;
-	attack_left[1].w = 74; attack_left[1].h = 59;
-
 	shoot_collision.h = 59;	shoot_collision.w = 74;
+
+	//Frames above are in full sheet coordinates, move them if the sheet was stripped
+	if (character_texture.getWidth() == PLAYER_SHEET.getWidth() && character_texture.getHeight() == PLAYER_SHEET.getHeight()){
+		PLAYER_SHEET.remap(idle_right, 4);
+		PLAYER_SHEET.remap(run_right, 4);
+		PLAYER_SHEET.remap(jump_right, 4);
+		PLAYER_SHEET.remap(power_right, 4);
+		PLAYER_SHEET.remap(attack_right, 2);
+		PLAYER_SHEET.remap(hurt_right, 3);
+	}
+
+	//Precompute the collision masks of every frame, one animation at a time
+	masks.build(character_texture, idle_right, 4);
+	masks.build(character_texture, run_right, 4);
+	masks.build(character_texture, jump_right, 4);
+	masks.build(character_texture, power_right, 4);
+	masks.build(character_texture, &attack_right[0], 1);
+	masks.build(character_texture, &attack_right[1], 1);
+	masks.build(character_texture, hurt_right, 3);
+	character_texture.free_pixels();
 }
 
+//Shared state of a co-op game, everything the netcode rolls back
+struct CoopState{
+	PlayerState players[2];
+	EnemyState enemies[11];
+	BehaviourState brains[11];
+	int deadTime;
+};
+
 class GamePlay{
 private:
+	//Second player of a co-op game, left out otherwise
+	Player Partner;
+	//Both players, only the first one plays alone
+	Player* players[2];
 	Player Player;
-	Enemy *enemies[10];
+	Enemy *enemies[11];
 	//Scene textures
 	Texture gPlayerTexture;
 	Texture background;
@@ -715,7 +6237,64 @@ private:
 	Texture win;
 	Texture over;
 	Mix_Music *Music;
+	SoundEffects sfx;
+	//Enemy behaviour scripts and their state, one per enemy
+	BehaviourVM behaviours;
+	BehaviourState brains[11];
+	//Way to the player for every enemy, searched on the workers
+	WorkerPool workers;
+	FlowField flow;
+	//Gameplay recording, off unless asked for
+	FrameCapture capture;
+	//Resolution the scene is drawn at, lowered when frames run late
+	ResolutionScaler scaler;
+	CaptureFormat captureFormat;
+	std::string capturePath;
+	//HUD text
+	TextRenderer hud;
+	//Sparks and dust, only for show so rollbacks leave them alone
+	ParticleSystem particles;
+	//Counted by the score consumer
+	std::atomic<int> kills;
+	//Furthest the player got from the start
+	int distance;
+	//Every finished run and the best of them
+	ScoreStore scores;
+	//Side effects of what happens in the game, handled off the game thread
+	EventBus events;
+	Telemetry telemetry;
+	std::string telemetryPath;
+	//Frames played
+	Uint32 frame;
+	//Frames every player has been down for
+	int deadTime;
+	//Co-op with another copy of the game over UDP, off unless asked for
+	bool coop;
+	RollbackSession netplay;
+	//Next settled frame to look for the end of a co-op game in
+	int coopSettled;
+	int coopPlayer;
+	int coopPorts[2];
+	std::string coopHost;
+	//Frames the co-op bot plays before quitting, 0 when a person plays
+	int botFrames;
+	Uint32 botNoise;
+	int botHold;
+	Uint8 botButtons;
+	//Frame rate cap of the game, for displays without vsync
+	FrameLimiter limiter;
+	//Redraw only what changed when the renderer is the software one
+	bool dirtyRects;
+	//Last frame before pausing, shown behind the pause screen
+	SDL_Texture* pauseSnapshot;
+	//Seconds spent playing
+	double playTime;
+	//Smoothed frames per second
+	float fps;
 public:
+	//Initializes variables
+	GamePlay();
+
 	//Starts up SDL and creates window
 	bool init();
 
@@ -725,20 +6304,103 @@ public:
 	//Frees media and shuts down SDL
 	void close();
 	void start();
-	bool checkCollision();
+	//Hits between a player and the enemies, side effects only when live
+	bool checkCollision(int index, bool live);
+	//Runs one frame of the game with the buttons of each player. Frames the netcode
+	//runs again are not live and publish no events.
+	void simulate(const Uint8* inputs, bool live);
+	//Ends a co-op game on frames both players agree on, or goes on alone when the
+	//other player left
+	void coop_outcome();
+	//Particles thrown by a player's shot and by the kills it makes
+	void shot_effect(int index, bool wasShooting);
+	void kill_effect(const Enemy& enemy, int index);
+	//Player this copy of the game controls
+	int local_player() const;
 	bool checkButton(SDL_Event e, int x1, int x2, int y1, int y2);
 	void camera_control();
 	void Menu();
+	//Waits, drawing nothing, until the game is resumed
+	void Pause();
+	//Copies the frame being drawn for the pause screen
+	void take_snapshot();
+	void draw_pause();
+	//Shows a full screen image for a while, sleeping in between
+	void show_screen(Texture& screen, Uint32 ms);
+	//Caps the frame rate of the game, 0 for no cap
+	void cap_fps(int fps);
+	void draw_hud();
+	void draw_highscores();
+	//Enemies, players and particles
+	void draw_sprites();
+	//Scene layers of the compositor
+	static void draw_scenery(void* data);
+	static void draw_actors(void* data);
+	//Draws whole frames even on the software renderer
+	void use_dirty_rects(bool enabled);
+	//Records the score of the run that just ended
+	void record_run();
+	void run_behaviours();
+	//Records the gameplay frames once the game starts
+	void record(CaptureFormat format, std::string path);
+	//Plays co-op as player 0 or 1 with the copy of the game at remotePort
+	void play_coop(int player, int localPort, int remotePort);
+	//Address of the other copy, localhost by default
+	void set_peer(std::string host);
+	//Drops and delays the packets sent to the other copy
+	void simulate_network(int loss, int latency, int jitter);
+	//A bot plays the local player for a number of frames, then the game quits
+	void play_bot(int frames);
+	Uint8 bot_input();
+	//Writes the game events to a CSV file once the game starts
+	void log_events(std::string path);
+	//Tells the event consumers about something that happened on this frame
+	void publish(GameEventType type, char enemy, int x, int y);
+	//Event consumers
+	static void play_sound(void* data, const GameEvent& event);
+	static void count_score(void* data, const GameEvent& event);
+	//Netcode callbacks
+	static void save_state(void* data, std::vector<Uint8>& state);
+	static void load_state(void* data, const std::vector<Uint8>& state);
+	static void step_frame(void* data, const Uint8* inputs, bool live);
 };
 
+GamePlay::GamePlay()
+{
+	captureFormat = CAPTURE_NONE;
+	pauseSnapshot = NULL;
+	players[0] = &Player;
+	players[1] = &Partner;
+	coop = false;
+	coopSettled = 0;
+	coopPlayer = 0;
+	coopPorts[0] = coopPorts[1] = 0;
+	coopHost = "127.0.0.1";
+	botFrames = 0;
+	botNoise = 1;
+	botHold = 0;
+	botButtons = 0;
+	dirtyRects = true;
+}
+
 bool GamePlay::init()
 {
 	Music = NULL;
+	kills = 0;
+	distance = 0;
+	frame = 0;
+	deadTime = 0;
+	playTime = 0;
+	fps = 0;
 	//Initialization flag
 	bool success = true;
+	gStartup.begin("init");
 
 	//Initialize SDL
-	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0)
+	gStartup.begin("SDL_Init");
+	int initialized = SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
+	gStartup.end();
+	if (initialized < 0)
 	{
 		printf("SDL could not initialize! SDL Error: %s\n", SDL_GetError());
 		success = false;
@@ -752,7 +6414,9 @@ bool GamePlay::init()
 		}
 
 		//Create window
+		gStartup.begin("window");
 		gWindow = SDL_CreateWindow("SEECS RUSH", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
+		gStartup.end();
 		if (gWindow == NULL)
 		{
 			printf("Window could not be created! SDL Error: %s\n", SDL_GetError());
@@ -761,7 +6425,9 @@ bool GamePlay::init()
 		else
 		{
 			//Create vsynced renderer for window
+			gStartup.begin("renderer");
 			gRenderer = SDL_CreateRenderer(gWindow, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+			gStartup.end();
 			if (gRenderer == NULL)
 			{
 				printf("Renderer could not be created! SDL Error: %s\n", SDL_GetError());
@@ -774,38 +6440,84 @@ bool GamePlay::init()
 
 				//Initialize PNG loading
 				int imgFlags = IMG_INIT_PNG;
-				if (!(IMG_Init(imgFlags) & imgFlags))
+				gStartup.begin("IMG_Init");
+				int imgInitialized = IMG_Init(imgFlags);
+				gStartup.end();
+				if (!(imgInitialized & imgFlags))
 				{
 					printf("SDL_image could not initialize! SDL_image Error: %s\n", IMG_GetError());
 					success = false;
 				}
+
+				//Initialize font loading
+				gStartup.begin("TTF_Init");
+				int ttfInitialized = TTF_Init();
+				gStartup.end();
+				if (ttfInitialized < 0)
+				{
+					printf("SDL_ttf could not initialize! SDL_ttf Error: %s\n", TTF_GetError());
+					success = false;
+				}
+
+				//The software renderer redraws only what changed, which a scaled frame never
+				//allows. Recording reads back whole frames from its own targets.
+				gStartup.begin("compositor");
+				bool compositing = dirtyRects && captureFormat == CAPTURE_NONE && gCompositor.init();
+				gStartup.end();
+				//Without a target the scene is always drawn at full resolution
+				gStartup.begin("scaling target");
+				if (!compositing)
+					scaler.init();
+				gStartup.end();
 			}
-			if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048) < 0)
+			gStartup.begin("Mix_OpenAudio");
+			int audioOpened = Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, AUDIO_BUFFER_FRAMES);
+			gStartup.end();
+			if (audioOpened < 0)
 			{
 				printf("SDL_mixer could not initialize! SDL_mixer Error: %s\n", Mix_GetError());
 				success = false;
 			}
 		}
 	}
+	gStartup.begin("workers");
+	workers.start(0);
+	gStartup.end();
+	gStartup.begin("enemies");
 	enemies[0] = new Enemy(Player.collisionTest.x + 800, Player.collisionTest.y + 60, 'd');
 	enemies[1] = new Enemy(Player.collisionTest.x + 1200, Player.collisionTest.y + 60, 'd');
-	enemies[2] = new Enemy(Player.collisionTest.x + 1500, Player.collisionTest.y + 50, 'm');
+	enemies[2] = new Enemy(Player.collisionTest.x + 1500, Player.collisionTest.y + 40, 'm');
 	enemies[3] = new Enemy(Player.collisionTest.x + 1900, Player.collisionTest.y + 60, 'd');
-	enemies[4] = new Enemy(Player.collisionTest.x + 2300, Player.collisionTest.y + 50, 'm');
+	enemies[4] = new Enemy(Player.collisionTest.x + 2300, Player.collisionTest.y + 40, 'm');
 	enemies[5] = new Enemy(Player.collisionTest.x + 2600, Player.collisionTest.y + 60, 'd');
-	enemies[6] = new Enemy(Player.collisionTest.x + 3000, Player.collisionTest.y + 50, 'm');
-	enemies[7] = new Enemy(Player.collisionTest.x + 2800, Player.collisionTest.y + 50, 'm');
+	enemies[6] = new Enemy(Player.collisionTest.x + 3000, Player.collisionTest.y + 40, 'm');
+	enemies[7] = new Enemy(Player.collisionTest.x + 2800, Player.collisionTest.y + 40, 'm');
 	enemies[8] = new Enemy(Player.collisionTest.x + 3200, Player.collisionTest.y + 60, 'd');
-	enemies[9] = new Enemy(Player.collisionTest.x + 3400, Player.collisionTest.y + 50, 'm');
-	enemies[10] = new Enemy(Player.collisionTest.x + 3600, Player.collisionTest.y + 50, 'm');
+	enemies[9] = new Enemy(Player.collisionTest.x + 3400, Player.collisionTest.y + 40, 'm');
+	enemies[10] = new Enemy(Player.collisionTest.x + 3650, Player.collisionTest.y + 40, 'm');
+	gStartup.end();
+	gStartup.end();
 	return success;
 }
 bool GamePlay::loadMedia()
 {
 	//Loading success flag
 	bool success = true;
+	gStartup.begin("loadMedia");
 
-	Music = Mix_LoadMUS("assets/music.mp3");
+	gStartup.begin("music");
+	SDL_RWops* music = gAssets.open_asset("assets/music.mp3");
+	Sint64 musicBytes = music != NULL ? SDL_RWsize(music) : 0;
+	Uint64 musicStart = SDL_GetPerformanceCounter();
+	Music = music != NULL ? Mix_LoadMUS_RW(music, 1) : NULL;
+	gStartup.asset("assets/music.mp3", musicBytes, SDL_GetPerformanceCounter() - musicStart, 0);
+	gStartup.end();
+	gStartup.begin("sound effects");
+	if (!sfx.load())
+	{
+		printf("Failed to load sound effects!\n");
+	}
+	gStartup.end();
 	//Load Player texture
 	/* if (!gPlayerTexture.load_image("assets/player1.png"))
 	{
@@ -814,11 +6526,22 @@ bool GamePlay::loadMedia()
 	}
 	*/
 	//Load background texture
+	gStartup.begin("background");
 	if (!background.load_image("assets/background1.png"))
 	{
 		printf("Failed to load background texture!\n");
 		success = false;
 	}
+	gStartup.end();
+	gStartup.begin("level");
+	if (!gLevel.load("assets/level1.txt"))
+	{
+		printf("Failed to load level!\n");
+		success = false;
+	}
+	flow.init(gLevel);
+	gStartup.end();
+	gStartup.begin("screens");
 	win.load_image("assets/win.png");
 	over.load_image("assets/over.png");
 	menu[0].load_image("assets/menu.png");
@@ -826,23 +6549,80 @@ bool GamePlay::loadMedia()
 	menu[2].load_image("assets/menu2.png");
 	menu[3].load_image("assets/menu3.png");
 	menu[4].load_image("assets/menu4.png");
-	menu[5].load_image("assets/highscore.png");
 	menu[6].load_image("assets/instructions.png");
+	gStartup.end();
+	gStartup.begin("font");
+	if (!hud.load_font("assets/gFont.otf", 28))
+	{
+		printf("Failed to load HUD font!\n");
+	}
+	gStartup.end();
+	gStartup.begin("particles");
+	if (!particles.init(16384))
+	{
+		printf("Failed to create particles!\n");
+	}
+	gStartup.end();
+	gStartup.begin("sprites");
 	Player.load_sprites();
-	for (int i = 0; i < 6; i++)
+	if (coop)
+	{
+		//Same sprites in another colour, starting a step behind
+		Partner.load_sprites();
+		Partner.character_texture.setColor(0x90, 0xC0, 0xFF);
+		Partner.mPosX = startPosX - 80;
+	}
+	for (int i = 0; i < 11; i++)
 		enemies[i]->load_sprite();
+	//The terrain shoves anything that starts inside it around
+	for (int i = 0; i < (coop ? 2 : 1); i++){
+		if (gLevel.overlaps(players[i]->getPosX(), players[i]->getPosY(), players[i]->body))
+			printf("Warning: player %d starts inside solid tiles at %d, %d!\n", i + 1, players[i]->getPosX(), players[i]->getPosY());
+	}
+	for (int i = 0; i < 11; i++){
+		if (gLevel.overlaps(enemies[i]->getPosX(), enemies[i]->getPosY(), enemies[i]->body))
+			printf("Warning: enemy %d starts inside solid tiles at %d, %d!\n", i, enemies[i]->getPosX(), enemies[i]->getPosY());
+	}
+	gStartup.end();
+	gStartup.begin("scores");
+	if (!scores.open("scores"))
+	{
+		printf("High scores will not be saved!\n");
+	}
+	gStartup.end();
+	gStartup.begin("behaviours");
+	if (!behaviours.load("assets/behaviours.txt"))
+	{
+		printf("Failed to load enemy behaviours!\n");
+		success = false;
+	}
+	for (int i = 0; i < 11; i++)
+		behaviours.start(brains[i], behaviours.find(enemies[i]->enemy_type == 'd' ? "dog" : "mummy"), i + 1);
+	gStartup.end();
+	gStartup.end();
 	return success;
 }
 
 void GamePlay::Menu(){
+	if (state != MENU)
+		return;
 	SDL_Event Event;
+	Event.type = SDL_FIRSTEVENT;
 	int flag = 0;
-	while (state == MENU || state == PAUSE)
+	//Screen on the window, menu[5] is the high scores drawn by draw_highscores
+	Texture* shown = NULL;
+	FrameLimiter menuLimiter;
+	menuLimiter.setRate(MENU_FPS);
+	while (state == MENU)
 	{
-		SDL_PollEvent(&Event);
+		if (Event.type == SDL_QUIT){
+			state = EXIT;
+			break;
+		}
 		//Set mouse over sprite
+		Texture* screen = &menu[0];
 		if (Event.type == SDL_MOUSEBUTTONUP && checkButton(Event, 40, 274, 165, 224) != true){
-			SDL_RenderCopy(gRenderer, menu[1].mTexture, NULL, NULL);
+			screen = &menu[1];
 			state = START;
 		}
 		else if (Event.type == SDL_MOUSEBUTTONUP && checkButton(Event, 40, 274, 272, 333) != true){
@@ -850,47 +6630,251 @@ void GamePlay::Menu(){
 				SDL_RenderCopy(gRenderer, menu[2].mTexture, NULL, NULL);
 				SDL_RenderPresent(gRenderer);
 				SDL_Delay(150);
+				shown = &menu[2];
 				flag = 1;
 			}
-			SDL_RenderCopy(gRenderer, menu[6].mTexture, NULL, NULL);
+			screen = &menu[6];
 		}
 		else if (Event.type == SDL_MOUSEBUTTONUP && checkButton(Event, 40, 274, 384, 449) != true){
 			if (flag == 0){
 				SDL_RenderCopy(gRenderer, menu[3].mTexture, NULL, NULL);
 				SDL_RenderPresent(gRenderer);
 				SDL_Delay(150);
+				shown = &menu[3];
 				flag = 1;
 			}
-			SDL_RenderCopy(gRenderer, menu[5].mTexture, NULL, NULL);
+			screen = &menu[5];
+		}
+		else if (Event.type == SDL_MOUSEBUTTONUP && checkButton(Event, 40, 274, 486, 556) != true){
+			screen = &menu[4];
+			state = EXIT;
+		}
+		else{
+			flag = 0;
+		}
+		//Mouse moves wake the menu up, the screen is only drawn again when it changes
+		//or the window lost it
+		bool exposed = Event.type == SDL_WINDOWEVENT && (Event.window.event == SDL_WINDOWEVENT_EXPOSED || Event.window.event == SDL_WINDOWEVENT_RESTORED);
+		if (screen != shown || exposed){
+			if (screen == &menu[5])
+				draw_highscores();
+			else
+				SDL_RenderCopy(gRenderer, screen->mTexture, NULL, NULL);
+			SDL_RenderPresent(gRenderer);
+			shown = screen;
+		}
+		if (gStartup.frame_presented())
+			state = EXIT;
+		//Nothing on the menu moves, sleep until there is input or the window needs drawing
+		menuLimiter.wait();
+		if (state == MENU)
+			SDL_WaitEvent(&Event);
+	}
+	//The menu is under the first frame of the game
+	gCompositor.invalidate();
+}
+
+void GamePlay::Pause(){
+	Mix_PauseMusic();
+	bool redraw = true;
+	while (state == PAUSE){
+		if (redraw){
+			draw_pause();
+			redraw = false;
 		}
-		else if (Event.type == SDL_MOUSEBUTTONUP && checkButton(Event, 40, 274, 486, 556) != true){
-			SDL_RenderCopy(gRenderer, menu[4].mTexture, NULL, NULL);
+		//Nothing changes while paused, so nothing runs until something happens
+		SDL_Event event;
+		if (SDL_WaitEvent(&event) == 0)
+			continue;
+		if (event.type == SDL_QUIT)
 			state = EXIT;
+		else if (event.type == SDL_KEYDOWN && event.key.repeat == 0 && (event.key.keysym.sym == SDLK_ESCAPE || event.key.keysym.sym == SDLK_p))
+			state = START;
+		else if (event.type == SDL_WINDOWEVENT && (event.window.event == SDL_WINDOWEVENT_EXPOSED || event.window.event == SDL_WINDOWEVENT_RESTORED))
+			redraw = true;
+	}
+	if (pauseSnapshot != NULL){
+		SDL_DestroyTexture(pauseSnapshot);
+		pauseSnapshot = NULL;
+	}
+	Mix_ResumeMusic();
+}
+
+void GamePlay::take_snapshot(){
+	if (pauseSnapshot != NULL)
+		SDL_DestroyTexture(pauseSnapshot);
+	pauseSnapshot = NULL;
+	std::vector<Uint8> pixels(SCREEN_WIDTH * SCREEN_HEIGHT * 4);
+	if (SDL_RenderReadPixels(gRenderer, NULL, SDL_PIXELFORMAT_RGBA32, &pixels[0], SCREEN_WIDTH * 4) != 0)
+		return;
+	pauseSnapshot = SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, SCREEN_WIDTH, SCREEN_HEIGHT);
+	if (pauseSnapshot != NULL)
+		SDL_UpdateTexture(pauseSnapshot, NULL, &pixels[0], SCREEN_WIDTH * 4);
+}
+
+void GamePlay::draw_pause(){
+	SDL_Color white = { 0xFF, 0xFF, 0xFF, 0xFF };
+	SDL_SetRenderDrawColor(gRenderer, 0x00, 0x00, 0x00, 0xFF);
+	SDL_RenderClear(gRenderer);
+	if (pauseSnapshot != NULL)
+		SDL_RenderCopy(gRenderer, pauseSnapshot, NULL, NULL);
+	//Dim the frozen game
+	SDL_SetRenderDrawBlendMode(gRenderer, SDL_BLENDMODE_BLEND);
+	SDL_SetRenderDrawColor(gRenderer, 0x00, 0x00, 0x00, 0xA0);
+	SDL_RenderFillRect(gRenderer, NULL);
+	SDL_SetRenderDrawBlendMode(gRenderer, SDL_BLENDMODE_NONE);
+	const char* title = "PAUSED";
+	const char* hint = "Press P or Esc to resume";
+	hud.draw_cached((SCREEN_WIDTH - hud.getWidth(title)) / 2, SCREEN_HEIGHT / 2 - hud.getHeight(), title, white);
+	hud.draw_cached((SCREEN_WIDTH - hud.getWidth(hint)) / 2, SCREEN_HEIGHT / 2 + hud.getHeight() / 2, hint, white);
+	hud.flush();
+	SDL_RenderPresent(gRenderer);
+}
+
+void GamePlay::show_screen(Texture& screen, Uint32 ms){
+	Uint32 end = SDL_GetTicks() + ms;
+	bool redraw = true;
+	for (;;){
+		if (redraw){
+			SDL_RenderCopy(gRenderer, screen.mTexture, NULL, NULL);
+			SDL_RenderPresent(gRenderer);
+			redraw = false;
 		}
-		else{
-			SDL_RenderCopy(gRenderer, menu[0].mTexture, NULL, NULL);
-			flag = 0;
-		}
-		SDL_RenderPresent(gRenderer);
-		SDL_Delay(100);
+		Uint32 now = SDL_GetTicks();
+		if ((Sint32)(end - now) <= 0)
+			break;
+		//Sleep until the time is up, waking only to redraw or quit
+		SDL_Event event;
+		if (SDL_WaitEventTimeout(&event, end - now) == 0)
+			continue;
+		if (event.type == SDL_QUIT)
+			break;
+		if (event.type == SDL_WINDOWEVENT && (event.window.event == SDL_WINDOWEVENT_EXPOSED || event.window.event == SDL_WINDOWEVENT_RESTORED))
+			redraw = true;
 	}
 }
 
-bool GamePlay::checkCollision(){
+void GamePlay::cap_fps(int fps){
+	limiter.setRate(fps);
+}
+
+bool GamePlay::checkCollision(int index, bool live){
 	for (int i = 0; i < 11; i++){
-		if (enemies[i]->collision(Player.collisionTest) && enemies[i]->death == 0){
-			Player.enemy_collision();
+		if (enemies[i]->collision(players[index]->collisionTest, players[index]->current_mask) && enemies[i]->death == 0){
+			if (players[index]->death == 0 && live)
+				publish(EVENT_PLAYER_HURT, enemies[i]->enemy_type, players[index]->getPosX(), players[index]->getPosY());
+			players[index]->enemy_collision();
 			return true;
 		}
-		if (enemies[i]->collision(Player.shoot_collision) && enemies[i]->death == 0 && Player.attacked == 1){
+		if (enemies[i]->collision(players[index]->shoot_collision, players[index]->shoot_mask) && enemies[i]->death == 0 && players[index]->attacked == 1){
 			enemies[i]->isDead();
-			Player.attacked = 0;
-			Player.blast = 0;
+			if (live){
+				publish(EVENT_ENEMY_KILLED, enemies[i]->enemy_type, enemies[i]->getPosX(), enemies[i]->getPosY());
+				kill_effect(*enemies[i], index);
+			}
+			players[index]->attacked = 0;
+			players[index]->blast = 0;
 		}
 	}
 	return false;
 }
 
+void GamePlay::simulate(const Uint8* inputs, bool live){
+	int count = coop ? 2 : 1;
+	//Everyone down counts towards game over
+	bool down = true;
+	for (int i = 0; i < count; i++){
+		if (!checkCollision(i, live) && players[i]->death == 0)
+			down = false;
+	}
+	if (down)
+		deadTime++;
+	for (int i = 0; i < count; i++)
+		players[i]->playerPosition();
+	run_behaviours();
+	for (int i = 0; i < 11; i++){
+		enemies[i]->animate();
+		enemies[i]->move(brains[i].walk, brains[i].jump);
+	}
+	for (int i = 0; i < count; i++){
+		players[i]->apply_input(inputs[i]);
+		bool wasShooting = players[i]->attacked == 1;
+		players[i]->animate();
+		if (live && players[i]->attacked == 1 && !wasShooting)
+			publish(EVENT_SHOT_FIRED, 0, players[i]->getPosX(), players[i]->getPosY());
+		if (live)
+			shot_effect(i, wasShooting);
+	}
+}
+
+void GamePlay::coop_outcome(){
+	//A live frame may rest on a predicted input that never happens
+	for (; coopSettled <= netplay.getSettledFrame(); coopSettled++){
+		const std::vector<Uint8>* bytes = netplay.getSettledState(coopSettled);
+		if (bytes == NULL)
+			continue;
+		const CoopState* settled = (const CoopState*)&(*bytes)[0];
+		for (int i = 0; i < 2; i++){
+			//Same test as collideScreen_right
+			if (settled->players[i].x >= LEVEL_WIDTH - 150){
+				publish(EVENT_LEVEL_WON, 0, settled->players[i].x, settled->players[i].y);
+				state = WIN;
+				return;
+			}
+		}
+		//Delay to show hurt animation
+		if (settled->deadTime > 45){
+			state = OVER;
+			return;
+		}
+	}
+	if (netplay.hasPeerLeft()){
+		printf("Player %d left the game!\n", 2 - local_player());
+		//Play on alone as the first player
+		if (local_player() == 1){
+			PlayerState alone;
+			Partner.save(alone);
+			Player.load(alone);
+		}
+		coop = false;
+		//The bot has nobody to play for
+		state = botFrames > 0 ? EXIT : MENU;
+	}
+}
+
+void GamePlay::shot_effect(int index, bool wasShooting){
+	SDL_Rect shot = players[index]->shotBody;
+	float x = (float)(players[index]->blastX + shot.x + shot.w / 2);
+	float y = (float)(players[index]->blastY + shot.y + shot.h / 2);
+	float back = players[index]->shotDirection == 'r' ? -1.0f : 1.0f;
+	if (players[index]->attacked == 1){
+		//Trail left behind the flying shot
+		SDL_Color trail = { 0x60, 0xA0, 0xFF, 0xC0 };
+		particles.burst(x, y, 3, 0.8f, 20, 5, trail, PARTICLE_DOT, back * 1.5f, -0.3f);
+	}
+	else if (wasShooting){
+		//Shot hit a wall or ran out of range
+		SDL_Color spark = { 0xFF, 0xE0, 0x80, 0xFF };
+		particles.burst(x, y, 40, 4, 30, 4, spark, PARTICLE_SPARK, back * 1.5f, -1.5f);
+	}
+}
+
+void GamePlay::kill_effect(const Enemy& enemy, int index){
+	float x = (float)(enemy.mPosX + enemy.body.x + enemy.body.w / 2);
+	float y = (float)(enemy.mPosY + enemy.body.y + enemy.body.h / 2);
+	float push = players[index]->shotDirection == 'r' ? 1.5f : -1.5f;
+	//Mummies fall to dust, dogs bleed
+	SDL_Color dust = { 0xD8, 0xC0, 0x88, 0xFF };
+	SDL_Color blood = { 0xC0, 0x20, 0x20, 0xFF };
+	particles.burst(x, y, 120, 3.5f, 60, 6, enemy.enemy_type == 'm' ? dust : blood, PARTICLE_DOT, push, -2);
+	SDL_Color spark = { 0xFF, 0xE0, 0x80, 0xFF };
+	particles.burst(x, y, 30, 5, 25, 4, spark, PARTICLE_SPARK, push, -1);
+}
+
+int GamePlay::local_player() const{
+	return coop ? netplay.getPlayer() : 0;
+}
+
 bool GamePlay::checkButton(SDL_Event e, int x1, int x2, int y1, int y2){
 	//Check if mouse is in button
 	bool inside = false;
@@ -929,8 +6913,9 @@ bool GamePlay::checkButton(SDL_Event e, int x1, int x2, int y1, int y2){
 
 void GamePlay::camera_control(){
 	//Center the camera over the Player
-	camera.x = (Player.getPosX() + Player::Player_WIDTH / 2) - SCREEN_WIDTH / 2 + 300;
-	camera.y = (Player.getPosY() + Player::Player_HEIGHT / 2) - SCREEN_HEIGHT / 2;
+	Character* local = players[local_player()];
+	camera.x = (local->getPosX() + Player::Player_WIDTH / 2) - SCREEN_WIDTH / 2 + 300;
+	camera.y = (local->getPosY() + Player::Player_HEIGHT / 2) - SCREEN_HEIGHT / 2;
 	//Keep the camera in bounds
 	if (camera.x < 0)
 	{
@@ -960,6 +6945,30 @@ void GamePlay::close()
 	}
 	win.free();
 	over.free();
+	hud.free();
+	particles.free();
+	scaler.free();
+	gCompositor.print_stats();
+	gCompositor.free();
+	//Consumers finish before the sounds they play are freed
+	events.stop();
+	events.print_stats();
+	telemetry.print_stats();
+	telemetry.close();
+	capture.stop();
+	capture.print_stats();
+	workers.stop();
+	netplay.stop();
+	netplay.print_stats();
+	//Waits for the last run to be written
+	scores.close();
+	sfx.print_stats();
+	sfx.free();
+	if (Music != NULL)
+	{
+		Mix_FreeMusic(Music);
+		Music = NULL;
+	}
 	//Destroy window	
 	SDL_DestroyRenderer(gRenderer);
 	SDL_DestroyWindow(gWindow);
@@ -967,10 +6976,244 @@ void GamePlay::close()
 	gRenderer = NULL;
 
 	//Quit SDL subsystems
+	Mix_CloseAudio();
+	TTF_Quit();
 	IMG_Quit();
 	SDL_Quit();
 }
 
+void GamePlay::run_behaviours(){
+	int count = coop ? 2 : 1;
+	//Lead the flow field to the middle of the player, the first one standing in co-op
+	Character* leader = players[0];
+	if (coop && players[0]->death != 0 && players[1]->death == 0)
+		leader = players[1];
+	int goalX = leader->getPosX() + leader->body.x + leader->body.w / 2;
+	int goalY = leader->getPosY() + leader->body.y + leader->body.h / 2;
+	//A search landing a frame later on one machine would play out differently on the other
+	if (coop)
+		flow.update_now(goalX, goalY);
+	else
+		flow.update(goalX, goalY, workers);
+	//Tell every script what its enemy sees, then run them all in one pass
+	for (int i = 0; i < 11; i++){
+		//Go after the nearest player still standing
+		Character* target = players[0];
+		for (int p = 1; p < count; p++){
+			bool closer = abs(players[p]->getPosX() - enemies[i]->getPosX()) < abs(target->getPosX() - enemies[i]->getPosX());
+			if (players[p]->death == 0 && (target->death != 0 || closer))
+				target = players[p];
+		}
+		int* inputs = brains[i].inputs;
+		inputs[SENSOR_PLAYER_DX] = target->getPosX() - enemies[i]->getPosX();
+		inputs[SENSOR_PLAYER_DY] = target->getPosY() - enemies[i]->getPosY();
+		inputs[SENSOR_GROUND] = enemies[i]->grounded;
+		inputs[SENSOR_BLOCKED] = enemies[i]->blocked;
+		const SDL_Rect& body = enemies[i]->body;
+		flow.sample(enemies[i]->getPosX() + body.x + body.w / 2, enemies[i]->getPosY() + body.y + body.h / 2, inputs[SENSOR_FLOW_X], inputs[SENSOR_FLOW_Y]);
+	}
+	behaviours.run(brains, 11);
+}
+
+void GamePlay::record(CaptureFormat format, std::string path){
+	captureFormat = format;
+	capturePath = path;
+}
+
+void GamePlay::log_events(std::string path){
+	telemetryPath = path;
+}
+
+void GamePlay::play_coop(int player, int localPort, int remotePort){
+	coop = true;
+	coopPlayer = player;
+	coopPorts[0] = localPort;
+	coopPorts[1] = remotePort;
+}
+
+void GamePlay::set_peer(std::string host){
+	coopHost = host;
+}
+
+void GamePlay::simulate_network(int loss, int latency, int jitter){
+	netplay.getLink().setConditions(loss, latency, jitter);
+}
+
+void GamePlay::play_bot(int frames){
+	botFrames = frames;
+}
+
+Uint8 GamePlay::bot_input(){
+	//Runs right, jumping and shooting at random and turning back now and then.
+	//Buttons are held for a while like a person would.
+	if (botHold-- > 0)
+		return botButtons;
+	botNoise = botNoise * 1664525 + 1013904223;
+	botHold = 5 + (botNoise >> 8) % 30;
+	int roll = (botNoise >> 16) % 100;
+	botButtons = roll < 70 ? BUTTON_RIGHT : roll < 85 ? BUTTON_LEFT : 0;
+	if ((botNoise >> 4) % 4 == 0)
+		botButtons |= BUTTON_JUMP;
+	if ((botNoise >> 12) % 5 == 0)
+		botButtons |= BUTTON_ATTACK;
+	return botButtons;
+}
+
+void GamePlay::publish(GameEventType type, char enemy, int x, int y){
+	GameEvent event = { (Uint8)type, enemy, frame, x, y };
+	events.publish(event);
+}
+
+void GamePlay::play_sound(void* data, const GameEvent& event){
+	SoundEffects* sfx = (SoundEffects*)data;
+	if (event.type == EVENT_SHOT_FIRED)
+		sfx->play(SFX_SHOT);
+	else if (event.type == EVENT_ENEMY_KILLED)
+		sfx->play(SFX_ENEMY_DEATH);
+	else if (event.type == EVENT_PLAYER_HURT)
+		sfx->play(SFX_PLAYER_HURT);
+}
+
+void GamePlay::count_score(void* data, const GameEvent& event){
+	GamePlay* game = (GamePlay*)data;
+	if (event.type == EVENT_ENEMY_KILLED)
+		game->kills++;
+}
+
+void GamePlay::save_state(void* data, std::vector<Uint8>& bytes){
+	GamePlay* game = (GamePlay*)data;
+	bytes.resize(sizeof(CoopState));
+	CoopState* state = (CoopState*)&bytes[0];
+	//The padding is checksummed with the rest
+	memset(state, 0, sizeof(CoopState));
+	game->Player.save(state->players[0]);
+	game->Partner.save(state->players[1]);
+	for (int i = 0; i < 11; i++){
+		game->enemies[i]->save(state->enemies[i]);
+		state->brains[i] = game->brains[i];
+	}
+	state->deadTime = game->deadTime;
+}
+
+void GamePlay::load_state(void* data, const std::vector<Uint8>& bytes){
+	GamePlay* game = (GamePlay*)data;
+	const CoopState* state = (const CoopState*)&bytes[0];
+	game->Player.load(state->players[0]);
+	game->Partner.load(state->players[1]);
+	for (int i = 0; i < 11; i++){
+		game->enemies[i]->load(state->enemies[i]);
+		game->brains[i] = state->brains[i];
+	}
+	game->deadTime = state->deadTime;
+}
+
+void GamePlay::step_frame(void* data, const Uint8* inputs, bool live){
+	((GamePlay*)data)->simulate(inputs, live);
+}
+
+void GamePlay::draw_hud(){
+	SDL_Color white = { 0xFF, 0xFF, 0xFF, 0xFF };
+	SDL_Color yellow = { 0xFF, 0xDD, 0x33, 0xFF };
+	char value[32];
+
+	//Labels never change, values are laid out every frame
+	hud.draw_cached(20, 15, "KILLS", white);
+	snprintf(value, sizeof(value), "%d", kills.load());
+	hud.draw(120, 15, value, yellow);
+
+	hud.draw_cached(220, 15, "TIME", white);
+	snprintf(value, sizeof(value), "%02d:%02d", (int)playTime / 60, (int)playTime % 60);
+	hud.draw(310, 15, value, yellow);
+
+	hud.draw_cached(SCREEN_WIDTH - 150, 15, "FPS", white);
+	snprintf(value, sizeof(value), "%.0f", fps);
+	hud.draw(SCREEN_WIDTH - 80, 15, value, yellow);
+
+	if (coop && !netplay.isConnected()){
+		const char* waiting = local_player() == 0 ? "Waiting for player 2" : "Waiting for player 1";
+		hud.draw_cached((SCREEN_WIDTH - hud.getWidth(waiting)) / 2, SCREEN_HEIGHT / 2, waiting, white);
+	}
+	hud.flush();
+}
+
+void GamePlay::draw_sprites(){
+	for (int i = 0; i < 11; i++)
+		enemies[i]->draw_enemy();
+	if (coop)
+		Partner.draw_image();
+	Player.draw_image();
+	particles.render(camera);
+}
+
+void GamePlay::draw_scenery(void* data){
+	GamePlay* game = (GamePlay*)data;
+	//Clear screen
+	SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
+	SDL_RenderClear(gRenderer);
+	//Render background
+	game->background.render(0, 0, &camera);
+	gLevel.render(camera);
+}
+
+void GamePlay::draw_actors(void* data){
+	GamePlay* game = (GamePlay*)data;
+	game->draw_sprites();
+	game->draw_hud();
+}
+
+void GamePlay::use_dirty_rects(bool enabled){
+	dirtyRects = enabled;
+}
+
+void GamePlay::draw_highscores(){
+	SDL_Color white = { 0xFF, 0xFF, 0xFF, 0xFF };
+	SDL_Color yellow = { 0xFF, 0xDD, 0x33, 0xFF };
+	static const int columns[] = { 180, 300, 480, 620, 760 };
+	SDL_SetRenderDrawColor(gRenderer, 0x00, 0x00, 0x00, 0xFF);
+	SDL_RenderClear(gRenderer);
+	const char* title = "HIGH SCORES";
+	hud.draw_cached((SCREEN_WIDTH - hud.getWidth(title)) / 2, 60, title, white);
+	hud.draw_cached(columns[1], 140, "SCORE", white);
+	hud.draw_cached(columns[2], 140, "KILLS", white);
+	hud.draw_cached(columns[3], 140, "TIME", white);
+	hud.draw_cached(columns[4], 140, "DISTANCE", white);
+
+	//Read straight from the mapped index
+	std::vector<ScoreRecord> best;
+	scores.top(best);
+	char value[32];
+	for (size_t i = 0; i < best.size(); i++){
+		int y = 190 + (int)i * 44;
+		snprintf(value, sizeof(value), "%d.", (int)i + 1);
+		hud.draw(columns[0], y, value, white);
+		snprintf(value, sizeof(value), "%u", best[i].score);
+		hud.draw(columns[1], y, value, yellow);
+		snprintf(value, sizeof(value), "%u", best[i].kills);
+		hud.draw(columns[2], y, value, yellow);
+		snprintf(value, sizeof(value), "%02u:%02u", best[i].time / 60000, best[i].time / 1000 % 60);
+		hud.draw(columns[3], y, value, yellow);
+		snprintf(value, sizeof(value), "%u", best[i].distance);
+		hud.draw(columns[4], y, value, yellow);
+	}
+	if (best.empty()){
+		const char* empty = "No runs yet";
+		hud.draw_cached((SCREEN_WIDTH - hud.getWidth(empty)) / 2, 190, empty, white);
+	}
+	hud.flush();
+}
+
+void GamePlay::record_run(){
+	ScoreRecord run;
+	memset(&run, 0, sizeof(run));
+	run.kills = kills.load();
+	run.time = (Uint32)(playTime * 1000);
+	run.distance = distance;
+	run.date = (Sint64)time(NULL);
+	run.score = ScoreStore::compute(run.kills, playTime, distance, state == WIN);
+	printf("Score %u: %u kills, %.1f s, %u px\n", run.score, run.kills, playTime, run.distance);
+	scores.submit(run);
+}
+
 void GamePlay::start(){
 	//Start up SDL and create window
 	if (!init())
@@ -986,59 +7229,132 @@ void GamePlay::start(){
 		}
 		else
 		{
+			//Play the music, looping forever
+			if (Music != NULL)
+			{
+				Mix_PlayMusic(Music, -1);
+			}
+			if (captureFormat != CAPTURE_NONE && !capture.start(captureFormat, capturePath))
+			{
+				printf("Failed to start capture!\n");
+			}
+			//The audio consumer is the only thread that queues sound effects
+			events.subscribe("audio", play_sound, &sfx, 1 << EVENT_SHOT_FIRED | 1 << EVENT_ENEMY_KILLED | 1 << EVENT_PLAYER_HURT);
+			events.subscribe("score", count_score, this, 1 << EVENT_ENEMY_KILLED);
+			events.subscribe("telemetry", Telemetry::record, &telemetry, (1 << EVENT_COUNT) - 1);
+			if (!telemetryPath.empty())
+			{
+				telemetry.open(telemetryPath);
+			}
+			events.start();
+			gCompositor.setScene(this, draw_scenery, draw_actors);
+			if (coop){
+				netplay.setGame(this, save_state, load_state, step_frame);
+				if (!netplay.start(coopPlayer, coopPorts[0], coopHost.c_str(), coopPorts[1])){
+					printf("Failed to start co-op!\n");
+					state = EXIT;
+				}
+				//The bot skips the menu
+				else if (botFrames > 0){
+					botNoise += coopPlayer * 7919;
+					state = START;
+				}
+			}
 			//Event handler
 			SDL_Event e;
+			Uint64 frameStart = SDL_GetPerformanceCounter();
+			//Part of the last frame spent before presenting
+			double busyTime = 0;
 			while (state != EXIT && state != OVER && state != WIN){
-				SDL_PollEvent(&e);
+				//Input handling reads the last event again when there is no new one
+				bool fresh = SDL_PollEvent(&e) != 0;
 				if (e.type == SDL_QUIT){
 					break;
 				}
+				//Pause on request and whenever the game can't be seen or played. The other
+				//player can't wait, so co-op never pauses.
+				if (fresh && state == START && !coop){
+					if (e.type == SDL_KEYDOWN && e.key.repeat == 0 && (e.key.keysym.sym == SDLK_ESCAPE || e.key.keysym.sym == SDLK_p))
+						state = PAUSE;
+					if (e.type == SDL_WINDOWEVENT && (e.window.event == SDL_WINDOWEVENT_FOCUS_LOST || e.window.event == SDL_WINDOWEVENT_MINIMIZED))
+						state = PAUSE;
+				}
 				Menu();
-				if (Player.collideScreen_right() == 1){
-					state = WIN;
-					break;
+				//Time the frame, menu time is not play time
+				Uint64 frameEnd = SDL_GetPerformanceCounter();
+				double frameTime = (double)(frameEnd - frameStart) / SDL_GetPerformanceFrequency();
+				frameStart = frameEnd;
+				if (frameTime > 0 && frameTime < 0.25){
+					playTime += frameTime;
+					fps = fps == 0 ? (float)(1 / frameTime) : fps * 0.95f + (float)(1 / frameTime) * 0.05f;
 				}
-
-				if (checkCollision() == true || Player.death == 1){
-					static int clock = 0;
-					clock++;
-					if (clock > 45){ //delay to show hurt animation
+				scaler.update(frameTime, busyTime);
+				//Handle input for the Player, the netcode brings in the other one's
+				if (coop){
+					netplay.advance(botFrames > 0 ? bot_input() : Player::read_keys());
+					if (botFrames > 0 && netplay.getFrame() >= botFrames)
+						state = EXIT;
+					coop_outcome();
+				}
+				else{
+					Uint8 inputs[2] = { Player::read_input(e), 0 };
+					simulate(inputs, true);
+					if (Player.collideScreen_right() == 1){
+						publish(EVENT_LEVEL_WON, 0, Player.getPosX(), Player.getPosY());
+						state = WIN;
+					}
+					if (deadTime > 45){ //delay to show hurt animation
 						state = OVER;
 					}
 				}
-				if (Mix_PlayingMusic() == 0)
-				{
-					//Play the music
-					Mix_PlayMusic(Music, -1);
-				}
+				distance = std::max(distance, players[local_player()]->getPosX() - startPosX);
+				if (state == WIN)
+					break;
 				camera_control();
-				//Clear screen
-				SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
-				SDL_RenderClear(gRenderer);
-				//Render background
-				background.render(0, 0, &camera);
-				Player.playerPosition();
-				for (int i = 0; i < 11; i++){
-					enemies[i]->draw_enemy();
-					enemies[i]->move();
+				particles.update();
+				if (gCompositor.isActive()){
+					//Draws and presents only the parts of the window that changed
+					gCompositor.compose(camera);
+					busyTime = (double)(SDL_GetPerformanceCounter() - frameStart) / SDL_GetPerformanceFrequency();
+					if (state == PAUSE)
+						take_snapshot();
 				}
-				//Handle input for the Player
-				Player.handleEvent(e);
-				Player.draw_image();
-				//Player.render(camera.x, camera.y);
-				//Update screen
-				SDL_RenderPresent(gRenderer);
+				else{
+					capture.begin_frame();
+					scaler.begin_frame();
+					draw_scenery(this);
+					draw_sprites();
+					//The HUD stays sharp at any scale
+					scaler.end_frame();
+					draw_hud();
+					//Player.render(camera.x, camera.y);
+					//Update screen
+					busyTime = (double)(SDL_GetPerformanceCounter() - frameStart) / SDL_GetPerformanceFrequency();
+					if (state == PAUSE)
+						take_snapshot();
+					capture.end_frame();
+				}
+				if (gStartup.frame_presented())
+					state = EXIT;
+				frame++;
+				if (state == PAUSE){
+					Pause();
+					//Time spent paused is not play time
+					frameStart = SDL_GetPerformanceCounter();
+					gCompositor.invalidate();
+				}
+				limiter.wait();
 			}
 
 			if (state == OVER){
-				SDL_RenderCopy(gRenderer, over.mTexture, NULL, NULL);
-				SDL_RenderPresent(gRenderer);
-				SDL_Delay(2500);
+				show_screen(over, 2500);
 			}
 			if (state == WIN){
-				SDL_RenderCopy(gRenderer, win.mTexture, NULL, NULL);
-				SDL_RenderPresent(gRenderer);
-				SDL_Delay(5000);
+				show_screen(win, 5000);
+			}
+			//The score consumer has long caught up with the last kills by now
+			if (state == OVER || state == WIN){
+				record_run();
 			}
 		}
 	}
@@ -1047,9 +7363,506 @@ void GamePlay::start(){
 
 }
 
+//Times the behaviour scripts of count enemies over a number of frames
+int benchmark_behaviours(int count, int frames)
+{
+	BehaviourVM vm;
+	if (!vm.load("assets/behaviours.txt"))
+		return 1;
+	std::vector<BehaviourState> states(count);
+	int scripts[2] = { vm.find("dog"), vm.find("mummy") };
+	for (int i = 0; i < count; i++)
+		vm.start(states[i], scripts[i % 2], i + 1);
+
+	Uint64 total = 0, worst = 0;
+	Uint32 noise = 1;
+	long long checksum = 0;
+	for (int f = 0; f < frames; f++){
+		//Inputs change every frame like they do in the game
+		for (int i = 0; i < count; i++){
+			noise = noise * 1664525 + 1013904223;
+			states[i].inputs[SENSOR_PLAYER_DX] = (int)(noise >> 20) - 2048;
+			states[i].inputs[SENSOR_PLAYER_DY] = 0;
+			states[i].inputs[SENSOR_GROUND] = 1;
+			states[i].inputs[SENSOR_BLOCKED] = (noise >> 8) % 50 == 0;
+			states[i].inputs[SENSOR_FLOW_X] = (noise >> 4) % 3 - 1;
+			states[i].inputs[SENSOR_FLOW_Y] = 0;
+		}
+		Uint64 start = SDL_GetPerformanceCounter();
+		vm.run(&states[0], count);
+		Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+		total += elapsed;
+		if (elapsed > worst)
+			worst = elapsed;
+		//Use the outputs so the run cannot be optimized away
+		for (int i = 0; i < count; i++)
+			checksum += states[i].walk + states[i].jump;
+	}
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	double average = total / frequency / frames * 1000;
+	printf("Behaviour VM: %d enemies, %d frames\n", count, frames);
+	printf("  avg %.3f ms, worst %.3f ms per frame, %.1f ns per enemy (checksum %lld)\n", average, worst / frequency * 1000, average * 1000000 / count, checksum);
+	return 0;
+}
+
+//Times flow field searches and swarms following the field over a number of frames,
+//count 0 runs swarms of 1000, 10000 and 50000
+int benchmark_flow(int count, int frames)
+{
+	if (!gLevel.load("assets/level1.txt"))
+		return 1;
+	WorkerPool workers;
+	workers.start(0);
+	FlowField field;
+	field.init(gLevel);
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	//Goal at the player's middle while running along the ground
+	int goalY = startPosY + 56;
+
+	const int searches = 200;
+	Uint64 start = SDL_GetPerformanceCounter();
+	for (int i = 0; i < searches; i++)
+		field.build(startPosX + i * 17, goalY);
+	double search = (SDL_GetPerformanceCounter() - start) / frequency / searches * 1000;
+	printf("Flow field: %dx%d tiles, %.3f ms per search, %d worker threads\n", gLevel.getColumns(), gLevel.getRows(), search, workers.getThreads());
+
+	int counts[] = { 1000, 10000, 50000 };
+	int runs = 3;
+	if (count > 0){
+		counts[0] = count;
+		runs = 1;
+	}
+	for (int run = 0; run < runs; run++){
+		Swarm swarm;
+		Uint32 noise = 1;
+		for (int i = 0; i < counts[run]; i++){
+			//Dropped in above the terrain anywhere along the level
+			noise = noise * 1664525 + 1013904223;
+			swarm.spawn((int)(noise >> 8) % (LEVEL_WIDTH - 100), 200 + (int)(noise >> 4) % 200);
+		}
+		field.build(startPosX, goalY);
+		Uint64 total = 0, worst = 0;
+		for (int f = 0; f < frames; f++){
+			//The player runs right, so the goal changes tile every few frames
+			int goalX = startPosX + f * 5 % (LEVEL_WIDTH - 400);
+			Uint64 begin = SDL_GetPerformanceCounter();
+			field.update(goalX, goalY, workers);
+			swarm.update(field, workers);
+			Uint64 elapsed = SDL_GetPerformanceCounter() - begin;
+			total += elapsed;
+			if (elapsed > worst)
+				worst = elapsed;
+		}
+		//Use the positions so the run cannot be optimized away
+		long long checksum = 0;
+		for (int i = 0; i < swarm.getCount(); i++)
+			checksum += swarm.getX(i) + swarm.getY(i);
+		double average = total / frequency / frames * 1000;
+		printf("  %d agents, %d frames: avg %.3f ms, worst %.3f ms per frame, %.1f ns per agent (checksum %lld)\n", counts[run], frames, average, worst / frequency * 1000, average * 1000000 / counts[run], checksum);
+	}
+	workers.stop();
+	return 0;
+}
+
+//Times moving and laying out count live particles over a number of frames, both
+//count against the 1 ms of CPU the particles get per frame
+int benchmark_particles(int count, int frames)
+{
+	if (count < 0 || frames <= 0)
+		return 1;
+	ParticleSystem particles;
+	particles.init(count);
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	SDL_Color color = { 0xFF, 0xE0, 0x80, 0xFF };
+	Uint32 noise = 1;
+	Uint64 total = 0, built = 0, worst = 0;
+	long long quads = 0;
+	for (int f = 0; f < frames; f++){
+		//Burst again as particles run out so count of them stay alive, all over the screen
+		while (particles.getCount() < count){
+			noise = noise * 1664525 + 1013904223;
+			particles.burst((float)((noise >> 8) % SCREEN_WIDTH), (float)((noise >> 4) % SCREEN_HEIGHT), std::min(64, count - particles.getCount()), 4, 90, 4, color, PARTICLE_DOT);
+		}
+		Uint64 start = SDL_GetPerformanceCounter();
+		particles.update();
+		Uint64 updated = SDL_GetPerformanceCounter();
+		particles.build(camera);
+		Uint64 end = SDL_GetPerformanceCounter();
+		total += updated - start;
+		built += end - updated;
+		worst = std::max(worst, end - start);
+		quads += particles.getQuads();
+	}
+	double update = total / frequency / frames * 1000;
+	double vertices = built / frequency / frames * 1000;
+	printf("Particles: %d live, %d frames, %s\n", count, frames, ParticleSystem::getPath());
+	printf("  update avg %.3f ms per frame, %.2f ns per particle\n", update, count > 0 ? update * 1000000 / count : 0);
+	printf("  vertices avg %.3f ms per frame, %lld quads on screen per frame\n", vertices, quads / frames);
+	printf("  CPU avg %.3f ms, worst %.3f ms per frame, %.0f%% of the 1 ms budget\n", update + vertices, worst / frequency * 1000, (update + vertices) * 100);
+	return 0;
+}
+
+//Times recording runs and opening the high scores of a store holding count runs
+int benchmark_scores(int count)
+{
+	std::string path = "bench_scores";
+	remove((path + ".log").c_str());
+	remove((path + ".idx").c_str());
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	ScoreStore store;
+	if (!store.open(path))
+		return 1;
+	Uint32 noise = 1;
+	Uint64 worst = 0;
+	Uint64 start = SDL_GetPerformanceCounter();
+	for (int i = 0; i < count; i++){
+		noise = noise * 1664525 + 1013904223;
+		ScoreRecord run;
+		memset(&run, 0, sizeof(run));
+		run.kills = noise >> 28;
+		run.time = (noise >> 8) % 300000;
+		run.distance = (noise >> 4) % (LEVEL_WIDTH - startPosX);
+		run.score = ScoreStore::compute(run.kills, run.time / 1000.0, run.distance, (noise & 7) == 0);
+		Uint64 begin = SDL_GetPerformanceCounter();
+		store.submit(run);
+		Uint64 elapsed = SDL_GetPerformanceCounter() - begin;
+		if (elapsed > worst)
+			worst = elapsed;
+	}
+	double submit = (SDL_GetPerformanceCounter() - start) / frequency * 1000;
+	start = SDL_GetPerformanceCounter();
+	store.close();
+	double written = (SDL_GetPerformanceCounter() - start) / frequency * 1000;
+	printf("High scores: %d runs\n", count);
+	printf("  submit %.3f ms total, worst %.3f ms, writer finished %.1f ms later\n", submit, worst / frequency * 1000, written);
+
+	//The screen opens from the index, whatever the size of the log
+	std::vector<ScoreRecord> best;
+	start = SDL_GetPerformanceCounter();
+	store.open(path);
+	store.top(best);
+	double opened = (SDL_GetPerformanceCounter() - start) / frequency * 1000;
+	store.close();
+	printf("  open and read top %d from the index: %.3f ms, best %u\n", (int)best.size(), opened, best.empty() ? 0 : best[0].score);
+
+	//Without it the log is scanned once on the writer thread
+	remove((path + ".idx").c_str());
+	start = SDL_GetPerformanceCounter();
+	store.open(path);
+	store.close();
+	double rebuilt = (SDL_GetPerformanceCounter() - start) / frequency * 1000;
+	store.open(path);
+	store.top(best);
+	store.close();
+	printf("  rebuild the index from the log: %.1f ms, best %u\n", rebuilt, best.empty() ? 0 : best[0].score);
+	remove((path + ".log").c_str());
+	remove((path + ".idx").c_str());
+	return 0;
+}
+
+//Times scrolling frames with and without recording them
+int benchmark_capture(CaptureFormat format, std::string path, int frames)
+{
+	if (SDL_Init(SDL_INIT_VIDEO) < 0 || !(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG))
+	{
+		printf("SDL could not initialize! SDL Error: %s\n", SDL_GetError());
+		return 1;
+	}
+	//No vsync, so the frame times are what the frames cost
+	gWindow = SDL_CreateWindow("SEECS RUSH", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_HIDDEN);
+	gRenderer = gWindow != NULL ? SDL_CreateRenderer(gWindow, -1, SDL_RENDERER_ACCELERATED) : NULL;
+	if (gRenderer == NULL)
+	{
+		printf("Renderer could not be created! SDL Error: %s\n", SDL_GetError());
+		return 1;
+	}
+	int result = 0;
+	{
+		Texture background;
+		if (!background.load_image("assets/background1.png") || !gLevel.load("assets/level1.txt"))
+			result = 1;
+		FrameCapture capture;
+		double average[2] = { 0, 0 };
+		double frequency = (double)SDL_GetPerformanceFrequency();
+		for (int pass = 0; pass < 2 && result == 0; pass++){
+			if (pass == 1 && !capture.start(format, path)){
+				result = 1;
+				break;
+			}
+			Uint64 total = 0;
+			for (int f = 0; f < frames; f++){
+				Uint64 start = SDL_GetPerformanceCounter();
+				camera.x = f * 7 % (LEVEL_WIDTH - SCREEN_WIDTH);
+				capture.begin_frame();
+				SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
+				SDL_RenderClear(gRenderer);
+				background.render(0, 0, &camera);
+				gLevel.render(camera);
+				capture.end_frame();
+				total += SDL_GetPerformanceCounter() - start;
+				//A failed output stops the capture and the timings mean nothing
+				if (pass == 1 && !capture.isRecording()){
+					result = 1;
+					break;
+				}
+			}
+			average[pass] = total / frequency / frames * 1000;
+		}
+		capture.stop();
+		if (result == 0){
+			printf("Capture benchmark: %d frames\n", frames);
+			printf("  without capture %.3f ms, with capture %.3f ms per frame (%+.1f%%)\n", average[0], average[1], average[0] > 0 ? (average[1] / average[0] - 1) * 100 : 0);
+			capture.print_stats();
+		}
+	}
+	SDL_DestroyRenderer(gRenderer);
+	SDL_DestroyWindow(gWindow);
+	gRenderer = NULL;
+	gWindow = NULL;
+	IMG_Quit();
+	SDL_Quit();
+	return result;
+}
+
+//Scene of the compositor benchmark, enemies standing or walking in front of a still camera
+struct CompositorScene{
+	Texture* background;
+	std::vector<Enemy*> enemies;
+
+	static void draw_scenery(void* data)
+	{
+		CompositorScene* scene = (CompositorScene*)data;
+		SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
+		SDL_RenderClear(gRenderer);
+		scene->background->render(0, 0, &camera);
+		gLevel.render(camera);
+	}
+
+	static void draw_actors(void* data)
+	{
+		CompositorScene* scene = (CompositorScene*)data;
+		for (size_t i = 0; i < scene->enemies.size(); i++)
+			scene->enemies[i]->draw_enemy();
+	}
+};
+
+//Times full redraws against redrawing what changed on the software renderer, with
+//moving of the enemies on screen walking and the rest standing still. Runs with the
+//camera still and then scrolling back and forth like it does after a running player.
+int benchmark_compositor(int moving, int frames)
+{
+	if (SDL_Init(SDL_INIT_VIDEO) < 0 || !(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG))
+	{
+		printf("SDL could not initialize! SDL Error: %s\n", SDL_GetError());
+		return 1;
+	}
+	SDL_SetHint(SDL_HINT_RENDER_DRIVER, "software");
+	gWindow = SDL_CreateWindow("SEECS RUSH", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_HIDDEN);
+	gRenderer = gWindow != NULL ? SDL_CreateRenderer(gWindow, -1, SDL_RENDERER_SOFTWARE) : NULL;
+	if (gRenderer == NULL || !gCompositor.init())
+	{
+		printf("Software renderer could not be created! SDL Error: %s\n", SDL_GetError());
+		return 1;
+	}
+	int result = 0;
+	{
+		Texture background;
+		if (!background.load_image("assets/background1.png") || !gLevel.load("assets/level1.txt"))
+			result = 1;
+		CompositorScene scene;
+		scene.background = &background;
+		//Spread along the ground in view
+		for (int i = 0; i < 8; i++){
+			Enemy* enemy = new Enemy(150 + i * 100, startPosY + (i % 2 ? 40 : 60), i % 2 ? 'm' : 'd');
+			enemy->load_sprite();
+			enemy->animate();
+			scene.enemies.push_back(enemy);
+		}
+		moving = std::min(moving, (int)scene.enemies.size());
+		gCompositor.setScene(&scene, CompositorScene::draw_scenery, CompositorScene::draw_actors);
+		double frequency = (double)SDL_GetPerformanceFrequency();
+		if (result == 0)
+			printf("Compositor benchmark: software renderer, %d of %d enemies moving, %d frames\n", moving, (int)scene.enemies.size(), frames);
+		for (int scroll = 0; scroll < 2 && result == 0; scroll++){
+			double average[2] = { 0, 0 };
+			for (int pass = 0; pass < 2; pass++){
+				Uint64 total = 0;
+				for (int f = 0; f < frames; f++){
+					Uint64 start = SDL_GetPerformanceCounter();
+					//A running player's pace, turning around every 100 frames
+					if (scroll)
+						camera.x = (f / 100 % 2 ? 100 - f % 100 : f % 100) * 3;
+					for (int i = 0; i < moving; i++){
+						//Back and forth every two seconds
+						scene.enemies[i]->animate();
+						scene.enemies[i]->move(f / 120 % 2 ? 2 : -2, 0);
+					}
+					if (pass == 0){
+						CompositorScene::draw_scenery(&scene);
+						CompositorScene::draw_actors(&scene);
+						SDL_RenderPresent(gRenderer);
+					}
+					else
+						gCompositor.compose(camera);
+					total += SDL_GetPerformanceCounter() - start;
+				}
+				average[pass] = total / frequency / frames * 1000;
+			}
+			printf("  camera %s: full redraw %.3f ms, changes only %.3f ms per frame (%.1fx)\n", scroll ? "scrolling" : "still", average[0], average[1], average[1] > 0 ? average[0] / average[1] : 0);
+		}
+		if (result == 0)
+			gCompositor.print_stats();
+		for (size_t i = 0; i < scene.enemies.size(); i++)
+			delete scene.enemies[i];
+	}
+	gCompositor.free();
+	SDL_DestroyRenderer(gRenderer);
+	SDL_DestroyWindow(gWindow);
+	gRenderer = NULL;
+	gWindow = NULL;
+	IMG_Quit();
+	SDL_Quit();
+	return result;
+}
+
 int main(int argc, char* args[])
 {
+	gStartup.start();
+	//Strip the mirrored facings from full sprite sheets exported from the .psd sources
+	if (argc == 4 && strcmp(args[1], "--strip-sheets") == 0)
+	{
+		std::string source = args[2], dest = args[3];
+		bool success = SDL_Init(0) == 0 && IMG_Init(IMG_INIT_PNG) != 0;
+		success = success && PLAYER_SHEET.strip(source + "/player.png", dest + "/player.png");
+		success = success && DOG_SHEET.strip(source + "/dog.png", dest + "/dog.png");
+		IMG_Quit();
+		SDL_Quit();
+		return success ? 0 : 1;
+	}
+	//Build an asset pack from the listed files instead of playing
+	if (argc >= 3 && strcmp(args[1], "--pack") == 0)
+	{
+		return AssetPack::build(args[2], args + 3, argc - 3) ? 0 : 1;
+	}
+	//Loose files in assets/ are used when there is no pack
+	gStartup.begin("asset pack");
+	if (gAssets.open("assets.pak"))
+		gStartup.setSource("assets.pak");
+	gStartup.end();
+	//Benchmark the behaviour scripts instead of playing
+	if (argc >= 2 && strcmp(args[1], "--bench-vm") == 0)
+	{
+		return benchmark_behaviours(argc >= 3 ? atoi(args[2]) : 10000, argc >= 4 ? atoi(args[3]) : 1000);
+	}
+	//Benchmark the flow field and swarms following it
+	if (argc >= 2 && strcmp(args[1], "--bench-flow") == 0)
+	{
+		return benchmark_flow(argc >= 3 ? atoi(args[2]) : 0, argc >= 4 ? atoi(args[3]) : 600);
+	}
+	//Time the particle system
+	if (argc >= 2 && strcmp(args[1], "--bench-particles") == 0)
+	{
+		return benchmark_particles(argc >= 3 ? atoi(args[2]) : 100000, argc >= 4 ? atoi(args[3]) : 600);
+	}
+	//Time the high score store
+	if (argc >= 2 && strcmp(args[1], "--bench-scores") == 0)
+	{
+		return benchmark_scores(argc >= 3 ? atoi(args[2]) : 1000000);
+	}
+	//Time the cost of recording frames
+	if (argc >= 4 && strcmp(args[1], "--bench-capture") == 0)
+	{
+		CaptureFormat format = FrameCapture::parse_format(args[2]);
+		if (format == CAPTURE_NONE)
+		{
+			printf("Unknown capture format %s, expected yuv, png or ffmpeg\n", args[2]);
+			return 1;
+		}
+		return benchmark_capture(format, args[3], argc >= 5 ? atoi(args[4]) : 300);
+	}
+	//Time the dirty rectangles of the software renderer against full redraws
+	if (argc >= 2 && strcmp(args[1], "--bench-compositor") == 0)
+	{
+		return benchmark_compositor(argc >= 3 ? atoi(args[2]) : 2, argc >= 4 ? atoi(args[3]) : 600);
+	}
 	GamePlay game;
+	for (int i = 1; i < argc; i++)
+	{
+		//Record the gameplay while playing
+		if (strcmp(args[i], "--capture") == 0 && i + 2 < argc)
+		{
+			CaptureFormat format = FrameCapture::parse_format(args[i + 1]);
+			if (format == CAPTURE_NONE)
+			{
+				printf("Unknown capture format %s, expected yuv, png or ffmpeg\n", args[i + 1]);
+				return 1;
+			}
+			game.record(format, args[i + 2]);
+			i += 2;
+		}
+		//Log the game events
+		else if (strcmp(args[i], "--telemetry") == 0 && i + 1 < argc)
+		{
+			game.log_events(args[i + 1]);
+			i++;
+		}
+		//Cap the frame rate where vsync does not
+		else if (strcmp(args[i], "--fps-cap") == 0 && i + 1 < argc)
+		{
+			game.cap_fps(atoi(args[i + 1]));
+			i++;
+		}
+		//Draw whole frames on the software renderer too
+		else if (strcmp(args[i], "--no-dirty-rects") == 0)
+		{
+			game.use_dirty_rects(false);
+		}
+		//Play co-op with another copy of the game over UDP
+		else if (strcmp(args[i], "--coop") == 0 && i + 3 < argc)
+		{
+			int player = atoi(args[i + 1]);
+			if (player != 1 && player != 2)
+			{
+				printf("Co-op player must be 1 or 2\n");
+				return 1;
+			}
+			game.play_coop(player - 1, atoi(args[i + 2]), atoi(args[i + 3]));
+			i += 3;
+		}
+		else if (strcmp(args[i], "--peer") == 0 && i + 1 < argc)
+		{
+			game.set_peer(args[i + 1]);
+			i++;
+		}
+		//Lose and delay co-op packets on purpose
+		else if (strcmp(args[i], "--net-sim") == 0 && i + 3 < argc)
+		{
+			game.simulate_network(atoi(args[i + 1]), atoi(args[i + 2]), atoi(args[i + 3]));
+			i += 3;
+		}
+		//Let a bot play co-op for a number of frames
+		else if (strcmp(args[i], "--coop-bot") == 0 && i + 1 < argc)
+		{
+			game.play_bot(atoi(args[i + 1]));
+			i++;
+		}
+		//Time the startup and exit once the first frame is up
+		else if (strcmp(args[i], "--profile-startup") == 0)
+		{
+			gStartup.setProfile(true);
+			gStartup.setReport("");
+			if (i + 1 < argc && args[i + 1][0] != '-')
+			{
+				gStartup.setReport(args[i + 1]);
+				i++;
+			}
+		}
+		else
+		{
+			printf("Unknown option %s\n", args[i]);
+			return 1;
+		}
+	}
 	game.start();
 	return 0;
 }
\ No newline at end of file